@@ -0,0 +1,142 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+#ifndef AQL_QUEUE_H
+#define AQL_QUEUE_H
+
+#include <stdint.h>
+#include "/p/hal/private/rocm/hsa/include/hsa/hsa.h"
+
+/*
+ * Producer side of an AQL queue: slot reservation, header publication and
+ * the doorbell. These only touch the hsa_queue_* and doorbell signal calls,
+ * so they work unchanged against a software stand-in of the queue.
+ */
+
+/*
+ * Waits until the ring has room for count more packets after index.
+ */
+static inline void aql_wait_for_space(hsa_queue_t* queue, uint64_t index, uint64_t count) {
+    while (index + count - hsa_queue_load_read_index_acquire(queue) > queue->size) {
+    }
+}
+
+/*
+ * Reserves count consecutive slots and returns the index of the first one.
+ *
+ * A HSA_QUEUE_TYPE_SINGLE queue has one producer, so the write index is
+ * simply loaded and stored. On a HSA_QUEUE_TYPE_MULTI queue producers race
+ * for slots: the atomic add hands every caller a disjoint range without a
+ * lock, and each caller then waits for the packet processor to free its own
+ * slots. The packet processor stops at the first header that is still
+ * invalid, so a slot that is reserved but not yet written is never run.
+ */
+static inline uint64_t aql_reserve(hsa_queue_t* queue, uint64_t count) {
+    uint64_t index;
+    if (queue->type == HSA_QUEUE_TYPE_SINGLE) {
+        index = hsa_queue_load_write_index_relaxed(queue);
+        hsa_queue_store_write_index_relaxed(queue, index + count);
+    } else {
+        index = hsa_queue_add_write_index_relaxed(queue, count);
+    }
+    aql_wait_for_space(queue, index, count);
+    return index;
+}
+
+/*
+ * Like aql_reserve() on a HSA_QUEUE_TYPE_MULTI queue, but claims the slots
+ * with a compare-and-swap only once they are free, and gives up instead of
+ * waiting. Returns 0 if the ring is full; a producer that has other work to
+ * do can retry later without holding slots in the meantime.
+ */
+static inline int aql_try_reserve(hsa_queue_t* queue, uint64_t count, uint64_t* index) {
+    uint64_t expected = hsa_queue_load_write_index_relaxed(queue);
+    for (;;) {
+        if (expected + count - hsa_queue_load_read_index_acquire(queue) > queue->size) {
+            return 0;
+        }
+        uint64_t seen = hsa_queue_cas_write_index_relaxed(queue, expected, expected + count);
+        if (seen == expected) {
+            *index = expected;
+            return 1;
+        }
+        expected = seen;
+    }
+}
+
+/*
+ * The packet at index in the ring.
+ */
+static inline hsa_kernel_dispatch_packet_t* aql_packet(hsa_queue_t* queue, uint64_t index) {
+    const uint32_t queueMask = queue->size - 1;
+    return &(((hsa_kernel_dispatch_packet_t*)(queue->base_address))[index&queueMask]);
+}
+
+/*
+ * Makes a filled packet of the given type visible to the packet processor.
+ * With barrier set the packet does not start before every earlier packet
+ * on the queue has completed.
+ */
+static inline void aql_publish_header(void* packet, hsa_packet_type_t type, int barrier) {
+    uint16_t header = 0;
+    header |= HSA_FENCE_SCOPE_SYSTEM << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE;
+    header |= HSA_FENCE_SCOPE_SYSTEM << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE;
+    header |= type << HSA_PACKET_HEADER_TYPE;
+    if (barrier) {
+        header |= 1 << HSA_PACKET_HEADER_BARRIER;
+    }
+
+    __atomic_store_n((uint16_t*)packet, header, __ATOMIC_RELEASE);
+}
+
+/*
+ * Makes a filled kernel dispatch packet visible to the packet processor.
+ */
+static inline void aql_publish(hsa_kernel_dispatch_packet_t* dispatch_packet) {
+    aql_publish_header(dispatch_packet, HSA_PACKET_TYPE_KERNEL_DISPATCH, 0);
+}
+
+/*
+ * Fills the body of a barrier-AND packet: the packet processor stops at it
+ * until every non-null signal in deps has reached 0. Unused dependency
+ * slots and the completion signal are null.
+ */
+static inline void aql_write_barrier_and(hsa_barrier_and_packet_t* barrier_packet, const hsa_signal_t* deps, int count) {
+    barrier_packet->reserved0 = 0;
+    barrier_packet->reserved1 = 0;
+    for (int i = 0; i < 5; i++) {
+        barrier_packet->dep_signal[i].handle = i < count ? deps[i].handle : 0;
+    }
+    barrier_packet->reserved2 = 0;
+    barrier_packet->completion_signal.handle = 0;
+}
+
+/*
+ * Rings the doorbell for the packet at index. With several producers the
+ * doorbell writes may arrive out of order. The HSA specification requires
+ * the packet processor of a multi-producer queue to tolerate that, so no
+ * ordering between producers is needed here.
+ */
+static inline void aql_ring(hsa_queue_t* queue, uint64_t index) {
+    hsa_signal_store_relaxed(queue->doorbell_signal, index);
+}
+
+#endif
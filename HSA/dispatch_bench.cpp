@@ -0,0 +1,139 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "hsa_dispatch.h"
+
+/*
+ * Dispatch-rate microbenchmark: issues many small vector_copy dispatches on
+ * one GPU, once ringing the doorbell per packet and once in batches
+ * published with a single doorbell write, and reports dispatches per second.
+ *
+ * Usage: dispatch_bench <vector_copy.brig> [dispatches] [batch size]
+ */
+
+#define BENCH_GRID 256
+#define BENCH_WORKGROUP 256
+
+struct __attribute__ ((aligned(16))) args_t {
+    void* in;
+    void* out;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <vector_copy.brig> [dispatches] [batch size]\n", argv[0]);
+        return 1;
+    }
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 0) : 10000;
+    size_t batch = argc > 3 ? strtoul(argv[3], NULL, 0) : 64;
+
+    Runtime runtime;
+    std::vector<Agent> agents = Agent::gpus();
+    if (agents.empty()) {
+        printf("No GPU agent found.\n");
+        return 1;
+    }
+    Program program(runtime, argv[1]);
+    Queue queue(agents[0]);
+    Executable executable(program, agents[0]);
+    Kernel kernel(executable, "&__vector_copy_kernel");
+    if (batch == 0 || batch > queue.queue->size) {
+        batch = queue.queue->size;
+    }
+    printf("Agent %s, %zu dispatches of %d work-items, batch size %zu\n", agents[0].name, count, BENCH_GRID, batch);
+
+    char* in = (char*)malloc(BENCH_GRID * 4);
+    char* out = (char*)malloc(BENCH_GRID * 4);
+    memset(in, 1, BENCH_GRID * 4);
+    hsa_check(hsa_memory_register(in, BENCH_GRID * 4), "Registering argument memory for input parameter");
+    hsa_check(hsa_memory_register(out, BENCH_GRID * 4), "Registering argument memory for output parameter");
+    args_t args;
+    args.in = in;
+    args.out = out;
+    Grid grid(BENCH_GRID, BENCH_WORKGROUP);
+
+    /*
+     * At most one pool's worth of packets is kept in flight, so steady
+     * state reuses pooled kernargs and signals instead of creating them.
+     */
+    size_t window = queue.kernargs->slots;
+
+    /*
+     * One doorbell write per packet.
+     */
+    std::vector<Dispatch> singles;
+    singles.reserve(count);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        if (i >= window) {
+            wait(singles[i - window]);
+        }
+        singles.push_back(dispatch(queue, kernel, grid, args));
+    }
+    for (size_t i = count > window ? count - window : 0; i < count; i++) {
+        wait(singles[i]);
+    }
+    double single_sec = seconds_since(start);
+
+    /*
+     * One doorbell write per batch.
+     */
+    std::vector<Launch> launches(batch, Launch(kernel, grid, &args, sizeof(args)));
+    std::vector<BatchDispatch> batches;
+    batches.reserve(count / batch + 1);
+    size_t batch_window = window / batch > 0 ? window / batch : 1;
+    size_t waited = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t done = 0; done < count; done += batch) {
+        if (batches.size() - waited >= batch_window) {
+            wait(batches[waited++]);
+        }
+        size_t n = (count - done < batch) ? count - done : batch;
+        batches.push_back(dispatch_batch(queue, &launches[0], n));
+    }
+    for (; waited < batches.size(); waited++) {
+        wait(batches[waited]);
+    }
+    double batch_sec = seconds_since(start);
+
+    printf("per-packet doorbell: %.3f s, %.0f dispatches/s\n", single_sec, count / single_sec);
+    printf("batched doorbell:    %.3f s, %.0f dispatches/s\n", batch_sec, count / batch_sec);
+    printf("kernarg allocations outside the pool: %llu\n", (unsigned long long)queue.kernargs->fallbacks);
+    printf("completion signals: %llu acquired, %llu created (%u pooled of at most %u)\n",
+           (unsigned long long)queue.signals->acquired, (unsigned long long)queue.signals->created,
+           queue.signals->pooled, queue.signals->size);
+
+    hsa_memory_deregister(in, BENCH_GRID * 4);
+    hsa_memory_deregister(out, BENCH_GRID * 4);
+    free(in);
+    free(out);
+    return 0;
+}
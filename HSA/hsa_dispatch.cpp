@@ -0,0 +1,1092 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include "hsa_dispatch.h"
+#include "aql_queue.h"
+
+void hsa_check(hsa_status_t status, const char* what) {
+    if (status != HSA_STATUS_SUCCESS && status != HSA_STATUS_INFO_BREAK) {
+        const char* reason = NULL;
+        hsa_status_string(status, &reason);
+        printf("%s failed: %s\n", what, reason ? reason : "unknown error");
+        exit(1);
+    }
+}
+
+/*
+ * Loads a BRIG module from a specified file. This
+ * function does not validate the module.
+ */
+static int load_module_from_file(const char* file_name, hsa_ext_module_t* module, size_t* module_size) {
+    FILE *fp = fopen(file_name, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size_t file_size = (size_t) (ftell(fp) * sizeof(char));
+    fseek(fp, 0, SEEK_SET);
+
+    char* buf = (char*) malloc(file_size);
+    size_t read_size = fread(buf, sizeof(char), file_size, fp);
+    fclose(fp);
+
+    if (read_size != file_size) {
+        free(buf);
+        return -1;
+    }
+    *module = (hsa_ext_module_t) buf;
+    *module_size = file_size;
+    return 0;
+}
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Appends every agent of type HSA_DEVICE_TYPE_GPU to the vector in data.
+ */
+static hsa_status_t collect_gpu_agents(hsa_agent_t agent, void *data) {
+    hsa_device_type_t device_type;
+    hsa_status_t status = hsa_agent_get_info(agent, HSA_AGENT_INFO_DEVICE, &device_type);
+    if (HSA_STATUS_SUCCESS == status && HSA_DEVICE_TYPE_GPU == device_type) {
+        ((std::vector<hsa_agent_t>*) data)->push_back(agent);
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Stores the first agent of type HSA_DEVICE_TYPE_CPU in data.
+ */
+static hsa_status_t find_cpu_agent(hsa_agent_t agent, void *data) {
+    hsa_device_type_t device_type;
+    hsa_status_t status = hsa_agent_get_info(agent, HSA_AGENT_INFO_DEVICE, &device_type);
+    if (HSA_STATUS_SUCCESS == status && HSA_DEVICE_TYPE_CPU == device_type) {
+        *(hsa_agent_t*)data = agent;
+        return HSA_STATUS_INFO_BREAK;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Determines if a memory region can be used for kernarg
+ * allocations.
+ */
+static hsa_status_t get_kernarg_memory_region(hsa_region_t region, void* data) {
+    hsa_region_segment_t segment;
+    hsa_region_get_info(region, HSA_REGION_INFO_SEGMENT, &segment);
+    if (HSA_REGION_SEGMENT_GLOBAL != segment) {
+        return HSA_STATUS_SUCCESS;
+    }
+
+    hsa_region_global_flag_t flags;
+    hsa_region_get_info(region, HSA_REGION_INFO_GLOBAL_FLAGS, &flags);
+    if (flags & HSA_REGION_GLOBAL_FLAG_KERNARG) {
+        hsa_region_t* ret = (hsa_region_t*) data;
+        *ret = region;
+        return HSA_STATUS_INFO_BREAK;
+    }
+
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Finds the agent's first coarse-grained global region and its first
+ * fine-grained one; data points at the two of them.
+ */
+static hsa_status_t get_global_memory_regions(hsa_region_t region, void* data) {
+    hsa_region_segment_t segment;
+    hsa_region_get_info(region, HSA_REGION_INFO_SEGMENT, &segment);
+    if (HSA_REGION_SEGMENT_GLOBAL != segment) {
+        return HSA_STATUS_SUCCESS;
+    }
+
+    hsa_region_global_flag_t flags;
+    hsa_region_get_info(region, HSA_REGION_INFO_GLOBAL_FLAGS, &flags);
+    hsa_region_t* ret = (hsa_region_t*) data;
+    if ((flags & HSA_REGION_GLOBAL_FLAG_COARSE_GRAINED) && ret[0].handle == (uint64_t)-1) {
+        ret[0] = region;
+    }
+    if ((flags & HSA_REGION_GLOBAL_FLAG_FINE_GRAINED) && ret[1].handle == (uint64_t)-1) {
+        ret[1] = region;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+Runtime::Runtime() {
+    hsa_check(hsa_init(), "Initializing the hsa runtime");
+
+    bool support = false;
+    hsa_check(hsa_system_extension_supported(HSA_EXTENSION_FINALIZER, 1, 0, &support),
+              "Checking finalizer 1.0 extension support");
+    if (!support) {
+        printf("Finalizer 1.0 extension is not supported.\n");
+        exit(1);
+    }
+    hsa_check(hsa_system_get_extension_table(HSA_EXTENSION_FINALIZER, 1, 0, &finalizer),
+              "Generating function table for finalizer");
+}
+
+Runtime::~Runtime() {
+    hsa_shut_down();
+}
+
+Agent::Agent(hsa_agent_t agent) : handle(agent) {
+    memset(name, 0, sizeof(name));
+    hsa_check(hsa_agent_get_info(handle, HSA_AGENT_INFO_NAME, name), "Querying the agent name");
+    hsa_check(hsa_agent_get_info(handle, HSA_AGENT_INFO_ISA, &isa), "Query the agents isa");
+    hsa_check(hsa_agent_get_info(handle, HSA_AGENT_INFO_QUEUE_MAX_SIZE, &queue_max_size),
+              "Querying the agent maximum queue size");
+
+    kernarg_region.handle = (uint64_t)-1;
+    hsa_agent_iterate_regions(handle, get_kernarg_memory_region, &kernarg_region);
+    hsa_check(kernarg_region.handle == (uint64_t)-1 ? HSA_STATUS_ERROR : HSA_STATUS_SUCCESS,
+              "Finding a kernarg memory region");
+
+    hsa_region_t regions[2] = {{(uint64_t)-1}, {(uint64_t)-1}};
+    hsa_check(hsa_agent_iterate_regions(handle, get_global_memory_regions, regions), "Finding the global memory regions");
+    local_region = regions[0];
+    system_region = regions[1].handle == (uint64_t)-1 ? kernarg_region : regions[1];
+}
+
+std::vector<Agent> Agent::gpus() {
+    std::vector<hsa_agent_t> handles;
+    hsa_check(hsa_iterate_agents(collect_gpu_agents, &handles), "Getting the gpu agents");
+
+    std::vector<Agent> agents;
+    for (size_t i = 0; i < handles.size(); i++) {
+        agents.push_back(Agent(handles[i]));
+    }
+    return agents;
+}
+
+SlotFlags::SlotFlags(uint32_t n) : count(n), cursor(0) {
+    busy = (uint8_t*)calloc(count, 1);
+}
+
+SlotFlags::~SlotFlags() {
+    free(busy);
+}
+
+int64_t SlotFlags::claim(uint32_t limit) {
+    /*
+     * Start each search at a different slot so concurrent callers do not
+     * all contend for the same flag.
+     */
+    uint32_t start = __atomic_fetch_add(&cursor, 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < limit; i++) {
+        uint32_t slot = (start + i) % limit;
+        if (!__atomic_exchange_n(&busy[slot], 1, __ATOMIC_ACQUIRE)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void SlotFlags::release(uint32_t slot) {
+    __atomic_store_n(&busy[slot], 0, __ATOMIC_RELEASE);
+}
+
+KernargPool::KernargPool(const Agent& a, uint32_t n, uint32_t size)
+    : agent(&a), slots(n), slot_size(size), fallbacks(0), flags(n) {
+    void* arena = NULL;
+    hsa_check(hsa_memory_allocate(a.kernarg_region, (size_t)slots * slot_size, &arena),
+              "Allocating the kernarg pool");
+    base = (char*)arena;
+}
+
+KernargPool::~KernargPool() {
+    hsa_memory_free(base);
+}
+
+void* KernargPool::acquire(size_t size) {
+    if (size <= slot_size) {
+        int64_t slot = flags.claim();
+        if (slot >= 0) {
+            return base + (size_t)slot * slot_size;
+        }
+    }
+
+    void* kernarg = NULL;
+    hsa_check(hsa_memory_allocate(agent->kernarg_region, size, &kernarg),
+              "Allocating kernel argument memory buffer");
+    __atomic_fetch_add(&fallbacks, 1, __ATOMIC_RELAXED);
+    return kernarg;
+}
+
+void KernargPool::release(void* kernarg) {
+    char* p = (char*)kernarg;
+    if (p >= base && p < base + (size_t)slots * slot_size) {
+        flags.release((p - base) / slot_size);
+    } else {
+        hsa_memory_free(kernarg);
+    }
+}
+
+static bool signal_less(hsa_signal_t a, hsa_signal_t b) {
+    return a.handle < b.handle;
+}
+
+SignalPool::SignalPool(uint32_t n, uint32_t initial)
+    : size(n), pooled(0), acquired(0), created(0), flags(n) {
+    signals = (hsa_signal_t*)calloc(size ? size : 1, sizeof(hsa_signal_t));
+    memset(ends, 0, sizeof(ends));
+    add_signals(std::min(initial, size));
+}
+
+SignalPool::~SignalPool() {
+    for (uint32_t i = 0; i < pooled; i++) {
+        hsa_signal_destroy(signals[i]);
+    }
+    free(signals);
+}
+
+bool SignalPool::grow(uint32_t seen) {
+    std::lock_guard<std::mutex> guard(grow_lock);
+    if (pooled != seen) {
+        return true;
+    }
+    if (pooled == size) {
+        return false;
+    }
+    add_signals(std::min<uint64_t>(size, pooled ? (uint64_t)pooled * 2 : SIGNAL_POOL_INITIAL));
+    return true;
+}
+
+/*
+ * Creates signals pooled..last as a new segment. Runs in the constructor or
+ * under grow_lock.
+ */
+void SignalPool::add_signals(uint32_t last) {
+    uint32_t first = pooled;
+    if (last <= first) {
+        return;
+    }
+    uint32_t segment = 0;
+    while (ends[segment] != 0) {
+        segment++;
+    }
+    if (segment == sizeof(ends) / sizeof(ends[0]) - 1) {
+        last = size;
+    }
+    for (uint32_t i = first; i < last; i++) {
+        hsa_check(hsa_signal_create(1, 0, NULL, &signals[i]), "Creating a HSA signal");
+    }
+    std::sort(signals + first, signals + last, signal_less);
+    ends[segment] = last;
+    __atomic_fetch_add(&created, last - first, __ATOMIC_RELAXED);
+
+    /* Publishes the new signals to acquire() and release(). */
+    __atomic_store_n(&pooled, last, __ATOMIC_RELEASE);
+}
+
+hsa_signal_t SignalPool::acquire(hsa_signal_value_t value) {
+    __atomic_fetch_add(&acquired, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        uint32_t seen = __atomic_load_n(&pooled, __ATOMIC_ACQUIRE);
+        int64_t slot = seen > 0 ? flags.claim(seen) : -1;
+        if (slot >= 0) {
+            hsa_signal_store_relaxed(signals[slot], value);
+            return signals[slot];
+        }
+        if (!grow(seen)) {
+            break;
+        }
+    }
+
+    hsa_signal_t signal;
+    hsa_check(hsa_signal_create(value, 0, NULL, &signal), "Creating a HSA signal");
+    __atomic_fetch_add(&created, 1, __ATOMIC_RELAXED);
+    return signal;
+}
+
+void SignalPool::release(hsa_signal_t signal) {
+    uint32_t count = __atomic_load_n(&pooled, __ATOMIC_ACQUIRE);
+    uint32_t begin = 0;
+    for (uint32_t segment = 0; begin < count; segment++) {
+        uint32_t end = ends[segment];
+        hsa_signal_t* it = std::lower_bound(signals + begin, signals + end, signal, signal_less);
+        if (it != signals + end && it->handle == signal.handle) {
+            flags.release(it - signals);
+            return;
+        }
+        begin = end;
+    }
+    hsa_signal_destroy(signal);
+}
+
+Queue::Queue(const Agent& a, uint32_t size, hsa_queue_type_t type) : agent(&a), queue(NULL) {
+    if (size == 0) {
+        size = a.queue_max_size;
+    }
+    hsa_check(hsa_queue_create(a.handle, size, type, NULL, NULL, UINT32_MAX, UINT32_MAX, &queue),
+              "Creating the queue");
+    kernargs = new KernargPool(a, size < KERNARG_POOL_SLOTS ? size : KERNARG_POOL_SLOTS);
+    signals = new SignalPool(size < SIGNAL_POOL_SLOTS ? size : SIGNAL_POOL_SLOTS, SIGNAL_POOL_INITIAL);
+}
+
+Queue::~Queue() {
+    delete signals;
+    delete kernargs;
+    hsa_queue_destroy(queue);
+}
+
+const char* memory_mode_name(MemoryMode mode) {
+    switch (mode) {
+    case MEMORY_DEVICE_LOCAL: return "device-local";
+    case MEMORY_ZERO_COPY: return "zero-copy";
+    }
+    return "unknown";
+}
+
+MemoryPool::MemoryPool(const Agent& a, MemoryMode m) : agent(&a), mode(m), allocations(0) {
+    if (mode == MEMORY_DEVICE_LOCAL && a.local_region.handle == (uint64_t)-1) {
+        mode = MEMORY_ZERO_COPY;
+    }
+    region = mode == MEMORY_DEVICE_LOCAL ? a.local_region : a.system_region;
+    hsa_check(hsa_region_get_info(region, HSA_REGION_INFO_RUNTIME_ALLOC_GRANULE, &granule),
+              "Querying the allocation granule");
+}
+
+MemoryPool::~MemoryPool() {
+    for (std::map<void*, size_t>::iterator it = sizes.begin(); it != sizes.end(); ++it) {
+        hsa_memory_free(it->first);
+    }
+}
+
+void* MemoryPool::allocate(size_t size) {
+    size = (size + granule - 1) / granule * granule;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::multimap<size_t, void*>::iterator it = free_buffers.find(size);
+        if (it != free_buffers.end()) {
+            void* buffer = it->second;
+            free_buffers.erase(it);
+            return buffer;
+        }
+    }
+
+    void* buffer = NULL;
+    hsa_check(hsa_memory_allocate(region, size, &buffer), mode == MEMORY_DEVICE_LOCAL
+              ? "Allocating device-local memory" : "Allocating zero-copy memory");
+    std::lock_guard<std::mutex> guard(lock);
+    sizes[buffer] = size;
+    allocations++;
+    return buffer;
+}
+
+void MemoryPool::release(void* buffer) {
+    std::lock_guard<std::mutex> guard(lock);
+    free_buffers.insert(std::make_pair(sizes[buffer], buffer));
+}
+
+void MemoryPool::upload(void* buffer, const void* host, size_t size) {
+    if (mode == MEMORY_DEVICE_LOCAL) {
+        hsa_check(hsa_memory_copy(buffer, host, size), "Copying to device-local memory");
+    } else {
+        memcpy(buffer, host, size);
+    }
+}
+
+void MemoryPool::download(void* host, const void* buffer, size_t size) {
+    if (mode == MEMORY_DEVICE_LOCAL) {
+        hsa_check(hsa_memory_copy(host, buffer, size), "Copying from device-local memory");
+    } else {
+        memcpy(host, buffer, size);
+    }
+}
+
+void MemoryPool::allow_access(const void* buffer, const Agent& peer) {
+    hsa_check(hsa_amd_agents_allow_access(1, &peer.handle, NULL, buffer), "Granting a peer agent access");
+}
+
+Program::Program(Runtime& rt, const char* brig_file) : runtime(&rt) {
+    if (load_module_from_file(brig_file, &module, &module_size) != 0) {
+        printf("Loading the BRIG module %s failed.\n", brig_file);
+        exit(1);
+    }
+    hash = fnv1a(module, module_size);
+
+    memset(&program, 0, sizeof(hsa_ext_program_t));
+    hsa_check(runtime->finalizer.hsa_ext_program_create(HSA_MACHINE_MODEL_LARGE, HSA_PROFILE_FULL,
+                  HSA_DEFAULT_FLOAT_ROUNDING_MODE_DEFAULT, NULL, &program), "Create the program");
+    hsa_check(runtime->finalizer.hsa_ext_program_add_module(program, module),
+              "Adding the brig module to the program");
+}
+
+Program::~Program() {
+    runtime->finalizer.hsa_ext_program_destroy(program);
+    free(module);
+}
+
+hsa_code_object_t Program::finalize(hsa_isa_t isa, const hsa_ext_control_directives_t* directives) {
+    hsa_ext_control_directives_t control_directives;
+    memset(&control_directives, 0, sizeof(hsa_ext_control_directives_t));
+    if (directives) {
+        control_directives = *directives;
+    }
+    hsa_code_object_t code_object;
+    hsa_check(runtime->finalizer.hsa_ext_program_finalize(program, isa, 0, control_directives, "",
+                  HSA_CODE_OBJECT_TYPE_PROGRAM, &code_object), "Finalizing the program");
+    return code_object;
+}
+
+static hsa_status_t alloc_serialized(size_t size, hsa_callback_data_t data, void** address) {
+    *address = malloc(size);
+    return *address ? HSA_STATUS_SUCCESS : HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+}
+
+/*
+ * Reads a serialized code object written by store_code_object(). Returns 0
+ * if there is none or it does not deserialize.
+ */
+static int load_code_object(const std::string& path, hsa_code_object_t* code_object) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t size = (size_t)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    void* buf = malloc(size);
+    size_t read_size = fread(buf, 1, size, fp);
+    fclose(fp);
+
+    int ok = read_size == size && hsa_code_object_deserialize(buf, size, "", code_object) == HSA_STATUS_SUCCESS;
+    free(buf);
+    return ok;
+}
+
+/*
+ * Serializes a code object to path. It is written to a temporary file and
+ * renamed into place, so concurrent launches never read a partial file. A
+ * failure only costs the next launch a finalization.
+ */
+static void store_code_object(const std::string& path, hsa_code_object_t code_object) {
+    void* buf = NULL;
+    size_t size = 0;
+    hsa_callback_data_t data = {0};
+    if (hsa_code_object_serialize(code_object, alloc_serialized, data, "", &buf, &size) != HSA_STATUS_SUCCESS) {
+        return;
+    }
+
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), ".%d.tmp", (int)getpid());
+    std::string tmp_path = path + tmp;
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (fp != NULL) {
+        size_t written = fwrite(buf, 1, size, fp);
+        if (fclose(fp) == 0 && written == size) {
+            rename(tmp_path.c_str(), path.c_str());
+        } else {
+            remove(tmp_path.c_str());
+        }
+    }
+    free(buf);
+}
+
+CodeObjectCache::CodeObjectCache(const char* d) : dir(d ? d : ""), hits(0), disk_hits(0), misses(0) {
+}
+
+CodeObjectCache::~CodeObjectCache() {
+    for (std::map<std::string, Entry*>::iterator it = code_objects.begin(); it != code_objects.end(); ++it) {
+        hsa_code_object_destroy(it->second->code_object);
+        delete it->second;
+    }
+}
+
+hsa_code_object_t CodeObjectCache::get(Program& program, hsa_isa_t isa, const hsa_ext_control_directives_t* directives) {
+    hsa_ext_control_directives_t control_directives;
+    memset(&control_directives, 0, sizeof(hsa_ext_control_directives_t));
+    if (directives) {
+        control_directives = *directives;
+    }
+
+    /*
+     * The ISA handle is only meaningful within this process, so the key
+     * uses the ISA name, which is also safe to put in a file name.
+     */
+    uint32_t name_length = 0;
+    hsa_check(hsa_isa_get_info(isa, HSA_ISA_INFO_NAME_LENGTH, 0, &name_length), "Querying the isa name length");
+    std::vector<char> name(name_length + 1, 0);
+    hsa_check(hsa_isa_get_info(isa, HSA_ISA_INFO_NAME, 0, &name[0]), "Querying the isa name");
+    for (size_t i = 0; i < name_length; i++) {
+        if (name[i] == '/' || name[i] == ':') {
+            name[i] = '_';
+        }
+    }
+    char key[256];
+    snprintf(key, sizeof(key), "%016llx-%s-%016llx", (unsigned long long)program.hash, &name[0],
+             (unsigned long long)fnv1a(&control_directives, sizeof(control_directives)));
+
+    Entry* entry;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Entry*& slot = code_objects[key];
+        if (slot == NULL) {
+            slot = new Entry();
+        }
+        entry = slot;
+    }
+
+    /*
+     * Finalize or deserialize outside the lock so other keys are not held
+     * up; callers of the same key block in call_once until it is done.
+     */
+    bool first = false;
+    std::call_once(entry->once, [&] {
+        first = true;
+        std::string path = dir.empty() ? "" : dir + "/" + key + ".hsaco";
+        if (!path.empty() && load_code_object(path, &entry->code_object)) {
+            __atomic_fetch_add(&disk_hits, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        entry->code_object = program.finalize(isa, &control_directives);
+        if (!path.empty()) {
+            store_code_object(path, entry->code_object);
+        }
+        __atomic_fetch_add(&misses, 1, __ATOMIC_RELAXED);
+    });
+    if (!first) {
+        __atomic_fetch_add(&hits, 1, __ATOMIC_RELAXED);
+    }
+    return entry->code_object;
+}
+
+Executable::Executable(Program& program, const Agent& a) : agent(&a), owns_code_object(true) {
+    code_object = program.finalize(a.isa);
+    load();
+}
+
+Executable::Executable(CodeObjectCache& cache, Program& program, const Agent& a) : agent(&a), owns_code_object(false) {
+    code_object = cache.get(program, a.isa);
+    load();
+}
+
+Executable::Executable(hsa_code_object_t co, const Agent& a) : agent(&a), code_object(co), owns_code_object(false) {
+    load();
+}
+
+void Executable::load() {
+    hsa_check(hsa_executable_create(HSA_PROFILE_FULL, HSA_EXECUTABLE_STATE_UNFROZEN, "", &executable),
+              "Create the executable");
+    hsa_check(hsa_executable_load_code_object(executable, agent->handle, code_object, ""),
+              "Loading the code object");
+    hsa_check(hsa_executable_freeze(executable, ""), "Freeze the executable");
+}
+
+Executable::~Executable() {
+    hsa_executable_destroy(executable);
+    if (owns_code_object) {
+        hsa_code_object_destroy(code_object);
+    }
+}
+
+Kernel::Kernel(const Executable& exe, const char* name) : agent(exe.agent) {
+    hsa_executable_symbol_t symbol;
+    hsa_check(hsa_executable_get_symbol(exe.executable, NULL, name, agent->handle, 0, &symbol),
+              "Extract the symbol from the executable");
+    hsa_check(hsa_executable_symbol_get_info(symbol, HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT, &object),
+              "Extracting the kernel object from the executable");
+    hsa_check(hsa_executable_symbol_get_info(symbol, HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE, &kernarg_segment_size),
+              "Extracting the kernarg segment size from the executable");
+    hsa_check(hsa_executable_symbol_get_info(symbol, HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_GROUP_SEGMENT_SIZE, &group_segment_size),
+              "Extracting the group segment size from the executable");
+    hsa_check(hsa_executable_symbol_get_info(symbol, HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_PRIVATE_SEGMENT_SIZE, &private_segment_size),
+              "Extracting the private segment from the executable");
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+Device::Device(CodeObjectCache& cache, Program& program, const Agent& a, const char* kernel_name) : agent(&a) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    queue = new Queue(a);
+    times.queue = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    hsa_code_object_t code_object = cache.get(program, a.isa);
+    times.finalize = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    executable = new Executable(code_object, a);
+    times.load = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    kernel = new Kernel(*executable, kernel_name);
+    times.symbol = seconds_since(start);
+}
+
+Device::~Device() {
+    delete kernel;
+    delete executable;
+    delete queue;
+}
+
+std::vector<Device*> bring_up(CodeObjectCache& cache, Program& program, const std::vector<Agent>& agents,
+                              const char* kernel_name, bool parallel) {
+    std::vector<Device*> devices(agents.size());
+    if (!parallel) {
+        for (size_t i = 0; i < agents.size(); i++) {
+            devices[i] = new Device(cache, program, agents[i], kernel_name);
+        }
+        return devices;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < agents.size(); i++) {
+        threads.push_back(std::thread([&, i] {
+            devices[i] = new Device(cache, program, agents[i], kernel_name);
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    return devices;
+}
+
+Grid::Grid(uint32_t x, uint16_t wg_x) : dimensions(1) {
+    size[0] = x; size[1] = 1; size[2] = 1;
+    workgroup[0] = wg_x; workgroup[1] = 1; workgroup[2] = 1;
+}
+
+Grid::Grid(uint32_t x, uint32_t y, uint16_t wg_x, uint16_t wg_y) : dimensions(2) {
+    size[0] = x; size[1] = y; size[2] = 1;
+    workgroup[0] = wg_x; workgroup[1] = wg_y; workgroup[2] = 1;
+}
+
+/*
+ * Fills everything but the header of a kernel dispatch packet.
+ */
+static void write_packet_body(hsa_kernel_dispatch_packet_t* dispatch_packet, const Kernel& kernel, const Grid& grid,
+                              void* kernarg, hsa_signal_t signal) {
+    dispatch_packet->setup = grid.dimensions << HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS;
+    dispatch_packet->workgroup_size_x = grid.workgroup[0];
+    dispatch_packet->workgroup_size_y = grid.workgroup[1];
+    dispatch_packet->workgroup_size_z = grid.workgroup[2];
+    dispatch_packet->reserved0 = 0;
+    dispatch_packet->grid_size_x = grid.size[0];
+    dispatch_packet->grid_size_y = grid.size[1];
+    dispatch_packet->grid_size_z = grid.size[2];
+    dispatch_packet->private_segment_size = kernel.private_segment_size;
+    dispatch_packet->group_segment_size = kernel.group_segment_size;
+    dispatch_packet->kernel_object = kernel.object;
+    dispatch_packet->kernarg_address = kernarg;
+    dispatch_packet->reserved2 = 0;
+    dispatch_packet->completion_signal = signal;
+}
+
+/*
+ * Exits if args do not fit the kernarg segment of kernel, since the buffer
+ * they are copied into is only that large.
+ */
+static void check_args_size(const Kernel& kernel, size_t args_size) {
+    hsa_check(args_size > kernel.kernarg_segment_size ? HSA_STATUS_ERROR_INVALID_ARGUMENT : HSA_STATUS_SUCCESS,
+              "Checking the arguments fit the kernarg segment");
+}
+
+Dispatch dispatch(Queue& q, const Kernel& kernel, const Grid& grid, const void* args, size_t args_size) {
+    check_args_size(kernel, args_size);
+    Dispatch d;
+    d.queue = &q;
+    d.signal = q.signals->acquire(1);
+    d.kernarg = q.kernargs->acquire(kernel.kernarg_segment_size);
+    memcpy(d.kernarg, args, args_size);
+
+    /*
+     * Reserve a slot, waiting for the packet processor if the ring is full,
+     * then fill it and ring the doorbell to dispatch the kernel.
+     */
+    hsa_queue_t* queue = q.queue;
+    uint64_t index = aql_reserve(queue, 1);
+    hsa_kernel_dispatch_packet_t* dispatch_packet = aql_packet(queue, index);
+    write_packet_body(dispatch_packet, kernel, grid, d.kernarg, d.signal);
+    aql_publish(dispatch_packet);
+    aql_ring(queue, index);
+    return d;
+}
+
+BatchDispatch dispatch_batch(Queue& q, const Launch* launches, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        check_args_size(*launches[i].kernel, launches[i].args_size);
+    }
+    BatchDispatch b;
+    b.queue = &q;
+    b.signal = q.signals->acquire((hsa_signal_value_t)count);
+    b.kernargs.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        b.kernargs[i] = q.kernargs->acquire(launches[i].kernel->kernarg_segment_size);
+        memcpy(b.kernargs[i], launches[i].args, launches[i].args_size);
+    }
+
+    /*
+     * A batch larger than the ring could never be reserved at once, so it
+     * goes out in ring-sized parts; each part waits for the packet
+     * processor to free the slots of the previous ones.
+     */
+    hsa_queue_t* queue = q.queue;
+    for (size_t first = 0; first < count; first += queue->size) {
+        size_t part = std::min<size_t>(count - first, queue->size);
+
+        /*
+         * Reserve all slots of the part with one write-index update. The
+         * packet processor stops at the first header that is still
+         * invalid, so it cannot run ahead into slots that are not written
+         * yet.
+         */
+        uint64_t index = aql_reserve(queue, part);
+        for (size_t i = 0; i < part; i++) {
+            const Launch& launch = launches[first + i];
+            write_packet_body(aql_packet(queue, index + i), *launch.kernel, launch.grid, b.kernargs[first + i], b.signal);
+        }
+
+        /*
+         * Publish last-to-first: the first header becomes valid only once
+         * the whole part is, so the part is picked up in one go.
+         */
+        for (size_t i = part; i > 0; i--) {
+            aql_publish(aql_packet(queue, index + i - 1));
+        }
+
+        aql_ring(queue, index + part - 1);
+    }
+    return b;
+}
+
+const char* wait_mode_name(WaitMode mode) {
+    switch (mode) {
+    case WAIT_SPIN: return "spin";
+    case WAIT_BLOCKED: return "blocked";
+    case WAIT_HYBRID: return "hybrid";
+    }
+    return "unknown";
+}
+
+void wait_signal(hsa_signal_t signal, WaitMode mode) {
+    if (mode == WAIT_SPIN || mode == WAIT_HYBRID) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (hsa_signal_load_acquire(signal) >= 1) {
+            if (mode == WAIT_HYBRID && seconds_since(start) * 1e6 > HYBRID_SPIN_USEC) {
+                break;
+            }
+        }
+    }
+    while (hsa_signal_wait_acquire(signal, HSA_SIGNAL_CONDITION_LT, 1, UINT64_MAX, HSA_WAIT_STATE_BLOCKED) >= 1) {
+    }
+}
+
+void wait(BatchDispatch& b, WaitMode mode) {
+    wait_signal(b.signal, mode);
+    for (size_t i = 0; i < b.kernargs.size(); i++) {
+        b.queue->kernargs->release(b.kernargs[i]);
+    }
+    b.queue->signals->release(b.signal);
+}
+
+void release(Dispatch& d) {
+    d.queue->kernargs->release(d.kernarg);
+    d.queue->signals->release(d.signal);
+}
+
+void wait(Dispatch& d, WaitMode mode) {
+    wait_signal(d.signal, mode);
+    release(d);
+}
+
+Waiter::Waiter() : stopping(false) {
+    uint64_t frequency = 0;
+    hsa_check(hsa_system_get_info(HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY, &frequency), "Querying the timestamp frequency");
+    block_ticks = frequency * WAITER_BLOCK_USEC / 1000000;
+    thread = std::thread(&Waiter::run, this);
+}
+
+Waiter::~Waiter() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void Waiter::watch(hsa_signal_t signal, std::function<void()> done) {
+    Watch w;
+    w.signal = signal;
+    w.done = done;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        watched.push_back(w);
+    }
+    wake.notify_one();
+}
+
+void Waiter::wait(hsa_signal_t signal) {
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    watch(signal, [&] {
+        std::lock_guard<std::mutex> guard(m);
+        done = true;
+        cv.notify_one();
+    });
+    std::unique_lock<std::mutex> guard(m);
+    cv.wait(guard, [&] { return done; });
+}
+
+void Waiter::run() {
+    std::vector<Watch> pending, still;
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [this] { return stopping || !watched.empty(); });
+        if (watched.empty()) {
+            return;
+        }
+
+        /*
+         * Poll without holding the lock so watch() never waits on a
+         * callback. New signals are appended behind the ones still pending.
+         */
+        pending.swap(watched);
+        guard.unlock();
+
+        still.clear();
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (hsa_signal_load_acquire(pending[i].signal) < 1) {
+                pending[i].done();
+            } else {
+                still.push_back(pending[i]);
+            }
+        }
+        if (still.size() == pending.size()) {
+            wait_signals.clear();
+            for (size_t i = 0; i < still.size(); i++) {
+                wait_signals.push_back(still[i].signal);
+            }
+            wait_conds.assign(still.size(), HSA_SIGNAL_CONDITION_LT);
+            wait_values.assign(still.size(), 1);
+            hsa_amd_signal_wait_any((uint32_t)still.size(), &wait_signals[0], &wait_conds[0], &wait_values[0],
+                                    block_ticks, HSA_WAIT_STATE_BLOCKED, NULL);
+        }
+        pending.clear();
+
+        guard.lock();
+        watched.insert(watched.begin(), still.begin(), still.end());
+    }
+}
+
+void wait(Dispatch& d, Waiter& waiter) {
+    waiter.wait(d.signal);
+    release(d);
+}
+
+void dispatch_async(Waiter& waiter, Queue& q, const Kernel& kernel, const Grid& grid, const void* args,
+                    size_t args_size, std::function<void()> done) {
+    Dispatch d = dispatch(q, kernel, grid, args, args_size);
+    waiter.watch(d.signal, [d, done]() mutable {
+        release(d);
+        if (done) {
+            done();
+        }
+    });
+}
+
+std::future<void> dispatch_async(Waiter& waiter, Queue& q, const Kernel& kernel, const Grid& grid, const void* args,
+                                 size_t args_size) {
+    std::shared_ptr<std::promise<void> > completed(new std::promise<void>());
+    std::future<void> future = completed->get_future();
+    dispatch_async(waiter, q, kernel, grid, args, args_size, [completed] { completed->set_value(); });
+    return future;
+}
+
+hsa_agent_t host_agent() {
+    hsa_agent_t agent = {(uint64_t)-1};
+    hsa_check(hsa_iterate_agents(find_cpu_agent, &agent), "Getting the cpu agent");
+    hsa_check(agent.handle == (uint64_t)-1 ? HSA_STATUS_ERROR : HSA_STATUS_SUCCESS, "Finding a cpu agent");
+    return agent;
+}
+
+void copy_async(void* dst, hsa_agent_t dst_agent, const void* src, hsa_agent_t src_agent, size_t size,
+                const std::vector<hsa_signal_t>& deps, hsa_signal_t completion) {
+    hsa_check(hsa_amd_memory_async_copy(dst, dst_agent, src, src_agent, size, (uint32_t)deps.size(),
+                                        deps.empty() ? NULL : &deps[0], completion),
+              "Starting an asynchronous copy");
+}
+
+TaskGraph::TaskGraph(uint32_t copies) : barriers(0), copy_signals(NULL), submitted(false) {
+    if (copies > 0) {
+        copy_signals = new SignalPool(copies, copies);
+    }
+}
+
+TaskGraph::~TaskGraph() {
+    if (submitted) {
+        wait();
+    }
+    delete copy_signals;
+}
+
+TaskGraph::Node TaskGraph::add(Queue& queue, const Kernel& kernel, const Grid& grid, const void* args, size_t args_size,
+                               const std::vector<Node>& deps) {
+    for (size_t i = 0; i < deps.size(); i++) {
+        if (deps[i] >= tasks.size()) {
+            printf("Task graph node %zu depends on node %zu, which is not added yet\n", tasks.size(), deps[i]);
+            exit(1);
+        }
+    }
+    check_args_size(kernel, args_size);
+    tasks.push_back(Task(queue, kernel, grid));
+    tasks.back().args.assign((const char*)args, (const char*)args + args_size);
+    tasks.back().deps = deps;
+    return tasks.size() - 1;
+}
+
+TaskGraph::Node TaskGraph::add_copy(void* dst, hsa_agent_t dst_agent, const void* src, hsa_agent_t src_agent, size_t size,
+                                    const std::vector<Node>& deps) {
+    for (size_t i = 0; i < deps.size(); i++) {
+        if (deps[i] >= tasks.size()) {
+            printf("Task graph node %zu depends on node %zu, which is not added yet\n", tasks.size(), deps[i]);
+            exit(1);
+        }
+    }
+    tasks.push_back(Task());
+    Task& task = tasks.back();
+    task.dst = dst;
+    task.dst_agent = dst_agent;
+    task.src = src;
+    task.src_agent = src_agent;
+    task.size = size;
+    task.deps = deps;
+    return tasks.size() - 1;
+}
+
+void TaskGraph::submit() {
+    /*
+     * The nodes of a previous round still hold their signals and kernarg
+     * buffers, which this round would take over while they are in flight.
+     */
+    if (submitted) {
+        wait();
+    }
+
+    size_t copies = 0;
+    for (size_t n = 0; n < tasks.size(); n++) {
+        copies += tasks[n].kernel == NULL ? 1 : 0;
+    }
+    if (copies > 0 && (copy_signals == NULL || copy_signals->size < copies)) {
+        delete copy_signals;
+        copy_signals = new SignalPool((uint32_t)copies, (uint32_t)copies);
+    }
+
+    for (size_t n = 0; n < tasks.size(); n++) {
+        Task& task = tasks[n];
+        if (task.kernel == NULL) {
+            std::vector<hsa_signal_t> deps;
+            for (size_t i = 0; i < task.deps.size(); i++) {
+                deps.push_back(tasks[task.deps[i]].dispatch.signal);
+            }
+            task.dispatch.signal = copy_signals->acquire(1);
+            copy_async(task.dst, task.dst_agent, task.src, task.src_agent, task.size, deps, task.dispatch.signal);
+            continue;
+        }
+
+        Queue& q = *task.queue;
+        task.dispatch.queue = &q;
+        task.dispatch.signal = q.signals->acquire(1);
+        task.dispatch.kernarg = q.kernargs->acquire(task.kernel->kernarg_segment_size);
+        memcpy(task.dispatch.kernarg, &task.args[0], task.args.size());
+
+        /*
+         * Copies and producers on another queue are waited for by
+         * barrier-AND packets, five signals each; a producer on this queue
+         * ran earlier on it, so the barrier bit is enough.
+         */
+        std::vector<hsa_signal_t> remote;
+        bool local = false;
+        for (size_t i = 0; i < task.deps.size(); i++) {
+            const Dispatch& producer = tasks[task.deps[i]].dispatch;
+            if (producer.queue == &q) {
+                local = true;
+            } else {
+                remote.push_back(producer.signal);
+            }
+        }
+        size_t barrier_count = (remote.size() + 4) / 5;
+
+        /*
+         * Barriers and the dispatch take consecutive slots and are
+         * published last-to-first, like a batch, so the dispatch can never
+         * be seen without the barriers in front of it.
+         */
+        hsa_queue_t* queue = q.queue;
+        uint64_t index = aql_reserve(queue, barrier_count + 1);
+        for (size_t b = 0; b < barrier_count; b++) {
+            size_t first = b * 5;
+            int count = (int)std::min<size_t>(5, remote.size() - first);
+            aql_write_barrier_and((hsa_barrier_and_packet_t*)aql_packet(queue, index + b), &remote[first], count);
+        }
+        hsa_kernel_dispatch_packet_t* dispatch_packet = aql_packet(queue, index + barrier_count);
+        write_packet_body(dispatch_packet, *task.kernel, task.grid, task.dispatch.kernarg, task.dispatch.signal);
+        aql_publish_header(dispatch_packet, HSA_PACKET_TYPE_KERNEL_DISPATCH, local);
+        for (size_t b = barrier_count; b > 0; b--) {
+            aql_publish_header(aql_packet(queue, index + b - 1), HSA_PACKET_TYPE_BARRIER_AND, 0);
+        }
+        aql_ring(queue, index + barrier_count);
+        barriers += barrier_count;
+    }
+    submitted = true;
+}
+
+void TaskGraph::wait(WaitMode mode) {
+    if (!submitted) {
+        return;
+    }
+    for (size_t n = 0; n < tasks.size(); n++) {
+        if (tasks[n].kernel == NULL) {
+            wait_signal(tasks[n].dispatch.signal, mode);
+            copy_signals->release(tasks[n].dispatch.signal);
+        } else {
+            ::wait(tasks[n].dispatch, mode);
+        }
+    }
+    submitted = false;
+}
+
+void TaskGraph::clear() {
+    if (submitted) {
+        wait();
+    }
+    tasks.clear();
+}
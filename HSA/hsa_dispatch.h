@@ -0,0 +1,716 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+#ifndef HSA_DISPATCH_H
+#define HSA_DISPATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "/p/hal/private/rocm/hsa/include/hsa/hsa.h"
+#include "/p/hal/private/rocm/hsa/include/hsa/hsa_ext_finalize.h"
+#include "/p/hal/private/rocm/hsa/include/hsa/hsa_ext_amd.h"
+
+/*
+ * A small dispatch library over the HSA runtime. It wraps the sequence the
+ * vector_copy examples spell out inline for every GPU: init, agent
+ * discovery, queue creation, finalization, executable and symbol lookup,
+ * kernarg allocation and AQL packet write. Everything that does not depend
+ * on the individual launch happens in the constructors, so dispatch() only
+ * fills and publishes one packet.
+ */
+
+/*
+ * Exits with a message if status is not HSA_STATUS_SUCCESS. Unlike the
+ * check() macro in the examples it is silent on success, so it can stay on
+ * the dispatch path.
+ */
+void hsa_check(hsa_status_t status, const char* what);
+
+/*
+ * Initializes the runtime and the finalizer 1.0 extension table; shuts the
+ * runtime down when destroyed.
+ */
+class Runtime {
+public:
+    Runtime();
+    ~Runtime();
+
+    hsa_ext_finalizer_1_00_pfn_t finalizer;
+};
+
+/*
+ * An agent together with the properties dispatch needs: its ISA, maximum
+ * queue size and the region kernel arguments are allocated from. Its
+ * coarse-grained and fine-grained global regions are found as well; a
+ * handle of (uint64_t)-1 means the agent has no such region.
+ */
+class Agent {
+public:
+    explicit Agent(hsa_agent_t handle);
+
+    /* All GPU agents, in enumeration order. */
+    static std::vector<Agent> gpus();
+
+    hsa_agent_t handle;
+    char name[64];
+    hsa_isa_t isa;
+    uint32_t queue_max_size;
+    hsa_region_t kernarg_region;
+    hsa_region_t local_region;
+    hsa_region_t system_region;
+};
+
+/*
+ * Kernarg buffers are carved from a pool of fixed-size slots; kernels with
+ * a larger kernarg segment fall back to a region allocation.
+ */
+#define KERNARG_SLOT_SIZE 256
+#define KERNARG_POOL_SLOTS 1024
+#define SIGNAL_POOL_SLOTS 1024
+#define SIGNAL_POOL_INITIAL 64
+
+/*
+ * Busy flags of a fixed set of slots, claimed and released without a lock
+ * from any number of threads.
+ */
+class SlotFlags {
+public:
+    explicit SlotFlags(uint32_t count);
+    ~SlotFlags();
+
+    /*
+     * Claims a free slot among the first limit ones and returns its index,
+     * or -1 if all of them are busy.
+     */
+    int64_t claim(uint32_t limit);
+    int64_t claim() { return claim(count); }
+    void release(uint32_t slot);
+
+    uint32_t count;
+
+private:
+    SlotFlags(const SlotFlags&);
+    SlotFlags& operator=(const SlotFlags&);
+
+    uint8_t* busy;
+    uint32_t cursor;
+};
+
+/*
+ * A kernarg arena allocated once from an agent's kernarg region. acquire()
+ * hands out a free slot and release() returns it once the dispatch that
+ * used it has completed, so steady-state dispatch does no runtime
+ * allocations. Both may be called from several threads. When every slot is
+ * in flight acquire() allocates from the region instead and counts it in
+ * fallbacks.
+ */
+class KernargPool {
+public:
+    KernargPool(const Agent& agent, uint32_t slots, uint32_t slot_size = KERNARG_SLOT_SIZE);
+    ~KernargPool();
+
+    void* acquire(size_t size);
+    void release(void* kernarg);
+
+    const Agent* agent;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint64_t fallbacks;
+
+private:
+    KernargPool(const KernargPool&);
+    KernargPool& operator=(const KernargPool&);
+
+    char* base;
+    SlotFlags flags;
+};
+
+/*
+ * Completion signals kept for reuse. Every hsa_signal_create costs a
+ * kernel event and an mmap, and the kernel driver has only 4096 events per
+ * process, so acquire() instead hands out a pooled signal reset to the
+ * requested value, and release() takes it back once it has been waited on.
+ * Both may be called from several threads. The pool starts with initial
+ * signals and, when they are all in flight, doubles up to size, so it
+ * holds about as many signals as were ever in flight at once. When size
+ * signals are in flight acquire() creates one and release() destroys it
+ * again. created counts every hsa_signal_create, so in steady state it
+ * stays at pooled.
+ */
+class SignalPool {
+public:
+    SignalPool(uint32_t size, uint32_t initial);
+    ~SignalPool();
+
+    hsa_signal_t acquire(hsa_signal_value_t value);
+    void release(hsa_signal_t signal);
+
+    uint32_t size;
+    uint32_t pooled;
+    uint64_t acquired;
+    uint64_t created;
+
+private:
+    SignalPool(const SignalPool&);
+    SignalPool& operator=(const SignalPool&);
+
+    /*
+     * Doubles the pool unless another thread grew it since pooled was seen;
+     * false once it holds size signals.
+     */
+    bool grow(uint32_t seen);
+    void add_signals(uint32_t last);
+
+    /*
+     * Pooled signals. Each growth appends a segment sorted by handle, so
+     * release() can find a signal's slot with one binary search per
+     * segment; ends[] holds the end of each segment.
+     */
+    hsa_signal_t* signals;
+    uint32_t ends[32];
+    SlotFlags flags;
+    std::mutex grow_lock;
+};
+
+/*
+ * An AQL queue on one agent. A size of 0 uses the agent's maximum queue
+ * size. A HSA_QUEUE_TYPE_MULTI queue may be fed by dispatch() and
+ * dispatch_batch() from several host threads at once. Dispatches to the
+ * queue take their kernarg buffers and completion signals from its pools.
+ * The kernarg pool holds one buffer per packet up to KERNARG_POOL_SLOTS;
+ * the signal pool starts with SIGNAL_POOL_INITIAL signals and grows with
+ * the dispatches in flight up to one per packet or SIGNAL_POOL_SLOTS.
+ */
+class Queue {
+public:
+    Queue(const Agent& agent, uint32_t size = 0, hsa_queue_type_t type = HSA_QUEUE_TYPE_SINGLE);
+    ~Queue();
+
+    const Agent* agent;
+    hsa_queue_t* queue;
+    KernargPool* kernargs;
+    SignalPool* signals;
+
+private:
+    Queue(const Queue&);
+    Queue& operator=(const Queue&);
+};
+
+/*
+ * Where kernel working buffers live.
+ *
+ * MEMORY_DEVICE_LOCAL allocates them from the agent's coarse-grained
+ * global region: the GPU caches them and its accesses cause no directory
+ * lookups or probes of host caches, but the host cannot touch them, so
+ * data is staged in and out with explicit copies. MEMORY_ZERO_COPY
+ * allocates them from the fine-grained system region, which host and GPU
+ * access directly and coherently; every GPU access then goes to system
+ * memory, as with hsa_memory_register on a malloc'd buffer.
+ */
+enum MemoryMode {
+    MEMORY_DEVICE_LOCAL,
+    MEMORY_ZERO_COPY
+};
+
+const char* memory_mode_name(MemoryMode mode);
+
+/*
+ * Working buffers of one agent in one MemoryMode. release() keeps a
+ * buffer for reuse by the next allocate() of the same rounded size, so a
+ * loop that allocates and frees the same buffers does no region
+ * allocation after the first iteration; the destructor frees them all.
+ * allocations counts region allocations. An agent without a coarse-grained
+ * region gets MEMORY_ZERO_COPY even if MEMORY_DEVICE_LOCAL was asked for.
+ * upload() and download() move data between host memory and a buffer of
+ * the pool, with hsa_memory_copy for device-local buffers and memcpy for
+ * zero-copy ones. allow_access() lets another agent, such as the source
+ * of a peer copy, access a buffer of the pool through
+ * hsa_amd_agents_allow_access. All calls may come from several threads.
+ */
+class MemoryPool {
+public:
+    MemoryPool(const Agent& agent, MemoryMode mode);
+    ~MemoryPool();
+
+    void* allocate(size_t size);
+    void release(void* buffer);
+
+    void upload(void* buffer, const void* host, size_t size);
+    void download(void* host, const void* buffer, size_t size);
+
+    void allow_access(const void* buffer, const Agent& peer);
+
+    const Agent* agent;
+    MemoryMode mode;
+    hsa_region_t region;
+    size_t granule;
+    uint64_t allocations;
+
+private:
+    MemoryPool(const MemoryPool&);
+    MemoryPool& operator=(const MemoryPool&);
+
+    std::mutex lock;
+    std::map<void*, size_t> sizes;
+    std::multimap<size_t, void*> free_buffers;
+};
+
+/*
+ * A BRIG module loaded from file and added to a finalizer program. The
+ * program is kept until destruction so it can be finalized for every ISA.
+ */
+class Program {
+public:
+    Program(Runtime& runtime, const char* brig_file);
+    ~Program();
+
+    /* NULL directives finalizes with all control directives cleared. */
+    hsa_code_object_t finalize(hsa_isa_t isa, const hsa_ext_control_directives_t* directives = NULL);
+
+    Runtime* runtime;
+    hsa_ext_module_t module;
+    hsa_ext_program_t program;
+    size_t module_size;
+    /* FNV-1a hash of the BRIG module contents. */
+    uint64_t hash;
+
+private:
+    Program(const Program&);
+    Program& operator=(const Program&);
+};
+
+/*
+ * Finalized code objects keyed by (BRIG hash, ISA, control directives).
+ * Agents that share an ISA get the same code object, so a program is
+ * finalized at most once per ISA in a process. With a directory the code
+ * objects are also serialized to disk and later launches deserialize them
+ * instead of finalizing. The cache owns its code objects and may be used
+ * from several threads; concurrent requests for the same key wait for one
+ * finalization instead of each running their own.
+ */
+class CodeObjectCache {
+public:
+    explicit CodeObjectCache(const char* dir = NULL);
+    ~CodeObjectCache();
+
+    hsa_code_object_t get(Program& program, hsa_isa_t isa, const hsa_ext_control_directives_t* directives = NULL);
+
+    std::string dir;
+    uint64_t hits;
+    uint64_t disk_hits;
+    uint64_t misses;
+
+private:
+    CodeObjectCache(const CodeObjectCache&);
+    CodeObjectCache& operator=(const CodeObjectCache&);
+
+    struct Entry {
+        std::once_flag once;
+        hsa_code_object_t code_object;
+    };
+
+    std::mutex lock;
+    std::map<std::string, Entry*> code_objects;
+};
+
+/*
+ * The program finalized for one agent's ISA, loaded and frozen. With a
+ * cache the code object comes from, and stays owned by, the cache.
+ */
+class Executable {
+public:
+    Executable(Program& program, const Agent& agent);
+    Executable(CodeObjectCache& cache, Program& program, const Agent& agent);
+    /* Loads a code object owned by the caller. */
+    Executable(hsa_code_object_t code_object, const Agent& agent);
+    ~Executable();
+
+    const Agent* agent;
+    hsa_code_object_t code_object;
+    hsa_executable_t executable;
+
+private:
+    Executable(const Executable&);
+    Executable& operator=(const Executable&);
+
+    void load();
+
+    bool owns_code_object;
+};
+
+/*
+ * A kernel symbol resolved once, with the segment sizes each dispatch needs.
+ */
+class Kernel {
+public:
+    Kernel(const Executable& executable, const char* name);
+
+    const Agent* agent;
+    uint64_t object;
+    uint32_t kernarg_segment_size;
+    uint32_t group_segment_size;
+    uint32_t private_segment_size;
+};
+
+/*
+ * Seconds each bring-up phase of a Device took.
+ */
+struct BringUpTimes {
+    double queue;
+    double finalize;
+    double load;
+    double symbol;
+};
+
+/*
+ * Everything one agent needs to dispatch a kernel: its queue, the program
+ * loaded for its ISA and the kernel symbol, with the time each step took.
+ */
+class Device {
+public:
+    Device(CodeObjectCache& cache, Program& program, const Agent& agent, const char* kernel_name);
+    ~Device();
+
+    const Agent* agent;
+    Queue* queue;
+    Executable* executable;
+    Kernel* kernel;
+    BringUpTimes times;
+
+private:
+    Device(const Device&);
+    Device& operator=(const Device&);
+};
+
+/*
+ * Brings up a Device for every agent. The shared steps (runtime, BRIG load,
+ * program) are the caller's; the per-agent ones run on one host thread per
+ * agent unless parallel is false, so start-up stays roughly flat in the
+ * number of GPUs. Devices are returned in agent order.
+ */
+std::vector<Device*> bring_up(CodeObjectCache& cache, Program& program, const std::vector<Agent>& agents,
+                              const char* kernel_name, bool parallel = true);
+
+/*
+ * Grid and workgroup sizes of a dispatch; unused dimensions are 1.
+ */
+struct Grid {
+    Grid(uint32_t x, uint16_t wg_x);
+    Grid(uint32_t x, uint32_t y, uint16_t wg_x, uint16_t wg_y);
+
+    uint16_t dimensions;
+    uint32_t size[3];
+    uint16_t workgroup[3];
+};
+
+/*
+ * An in-flight dispatch: the completion signal and the kernarg buffer that
+ * must stay alive until it completes, with the queue whose pools they go
+ * back to.
+ */
+struct Dispatch {
+    hsa_signal_t signal;
+    void* kernarg;
+    Queue* queue;
+};
+
+/*
+ * Copies args into a kernarg buffer, writes one kernel dispatch packet to
+ * queue and rings the doorbell. args_size must not exceed the kernel's
+ * kernarg segment size; larger arguments are an error, as they are for
+ * dispatch_batch() and TaskGraph::add().
+ */
+Dispatch dispatch(Queue& queue, const Kernel& kernel, const Grid& grid, const void* args, size_t args_size);
+
+template <class Args>
+Dispatch dispatch(Queue& queue, const Kernel& kernel, const Grid& grid, const Args& args) {
+    return dispatch(queue, kernel, grid, &args, sizeof(args));
+}
+
+/*
+ * How a host thread waits for a completion signal to drop below 1.
+ *
+ * WAIT_SPIN polls the signal and never sleeps: lowest wake-up latency, one
+ * core busy for the whole wait. WAIT_BLOCKED sleeps in the runtime until
+ * the signal's interrupt: no CPU, but an interrupt and a reschedule on
+ * every wake-up. WAIT_HYBRID polls for up to HYBRID_SPIN_USEC and then
+ * blocks, so short dispatches get spin latency and long ones cost no CPU.
+ */
+enum WaitMode {
+    WAIT_SPIN,
+    WAIT_BLOCKED,
+    WAIT_HYBRID
+};
+
+#define HYBRID_SPIN_USEC 50
+
+const char* wait_mode_name(WaitMode mode);
+
+void wait_signal(hsa_signal_t signal, WaitMode mode);
+
+/*
+ * Blocks until the dispatch completes, then returns its signal and kernarg
+ * buffer to the queue's pools.
+ */
+void wait(Dispatch& d, WaitMode mode = WAIT_BLOCKED);
+
+/*
+ * Returns the signal and kernarg buffer of a completed dispatch to the
+ * queue's pools without waiting.
+ */
+void release(Dispatch& d);
+
+/*
+ * One launch of a batch submitted with dispatch_batch().
+ */
+struct Launch {
+    Launch(const Kernel& k, const Grid& g, const void* a, size_t size)
+        : kernel(&k), grid(g), args(a), args_size(size) {}
+
+    const Kernel* kernel;
+    Grid grid;
+    const void* args;
+    size_t args_size;
+};
+
+/*
+ * A submitted batch: one completion signal that every packet of the batch
+ * decrements, and the kernarg buffers of all its packets.
+ */
+struct BatchDispatch {
+    hsa_signal_t signal;
+    std::vector<void*> kernargs;
+    Queue* queue;
+};
+
+/*
+ * Submits count launches to queue at once: reserves count slots with a
+ * single write-index update, fills every packet body, publishes the headers
+ * last-to-first so the packet processor never sees a partial batch, and
+ * rings the doorbell once. A batch larger than the queue is split into
+ * queue-sized parts, each submitted that way once the packet processor has
+ * freed enough slots, so the call then blocks until all but the last part
+ * have been picked up. Every packet takes a kernarg buffer; beyond
+ * KERNARG_POOL_SLOTS in flight they are allocated from the kernarg region.
+ * The whole batch shares one completion signal.
+ */
+BatchDispatch dispatch_batch(Queue& queue, const Launch* launches, size_t count);
+
+/*
+ * Blocks until every packet of the batch completes, then returns its signal
+ * and kernarg buffers to the queue's pools.
+ */
+void wait(BatchDispatch& b, WaitMode mode = WAIT_BLOCKED);
+
+/*
+ * One host thread that waits on behalf of many: watch() hands it a signal
+ * and a function to run once the signal drops below 1. The thread polls
+ * every watched signal in turn and, when a pass finds nothing complete,
+ * blocks on all of them in hsa_amd_signal_wait_any for up to
+ * WAITER_BLOCK_USEC. It needs no CPU while the GPU is busy, wakes on
+ * whichever signal completes first, and picks up newly watched signals
+ * within that time. This replaces one sleeping thread per signal.
+ * Callbacks run on the waiter thread in completion order; the destructor
+ * runs every pending callback first.
+ */
+#define WAITER_BLOCK_USEC 100
+
+class Waiter {
+public:
+    Waiter();
+    ~Waiter();
+
+    void watch(hsa_signal_t signal, std::function<void()> done);
+
+    /* Blocks the calling thread until the waiter thread sees the signal complete. */
+    void wait(hsa_signal_t signal);
+
+private:
+    Waiter(const Waiter&);
+    Waiter& operator=(const Waiter&);
+
+    void run();
+
+    /* Arguments of hsa_amd_signal_wait_any, kept to avoid reallocating them. */
+    std::vector<hsa_signal_t> wait_signals;
+    std::vector<hsa_signal_condition_t> wait_conds;
+    std::vector<hsa_signal_value_t> wait_values;
+
+    struct Watch {
+        hsa_signal_t signal;
+        std::function<void()> done;
+    };
+
+    uint64_t block_ticks;
+    bool stopping;
+    std::vector<Watch> watched;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread thread;
+};
+
+/*
+ * Waits for the dispatch through waiter, then releases it.
+ */
+void wait(Dispatch& d, Waiter& waiter);
+
+/*
+ * Asynchronous dispatch: the packet is submitted as by dispatch(), and once
+ * it completes waiter releases it and runs done on its own thread, so the
+ * submitting thread never blocks. done should be short, since the waiter
+ * notices no other completion while it runs.
+ */
+void dispatch_async(Waiter& waiter, Queue& queue, const Kernel& kernel, const Grid& grid, const void* args,
+                    size_t args_size, std::function<void()> done);
+
+template <class Args>
+void dispatch_async(Waiter& waiter, Queue& queue, const Kernel& kernel, const Grid& grid, const Args& args,
+                    std::function<void()> done) {
+    dispatch_async(waiter, queue, kernel, grid, &args, sizeof(args), done);
+}
+
+/*
+ * Asynchronous dispatch returning a future that becomes ready once the
+ * packet has completed and been released; longer host-side follow-up work
+ * can then run on the thread that takes the future.
+ */
+std::future<void> dispatch_async(Waiter& waiter, Queue& queue, const Kernel& kernel, const Grid& grid, const void* args,
+                                 size_t args_size);
+
+template <class Args>
+std::future<void> dispatch_async(Waiter& waiter, Queue& queue, const Kernel& kernel, const Grid& grid, const Args& args) {
+    return dispatch_async(waiter, queue, kernel, grid, &args, sizeof(args));
+}
+
+/*
+ * The first CPU agent: the agent that owns host memory in copy_async().
+ */
+hsa_agent_t host_agent();
+
+/*
+ * Starts copying size bytes from src, owned by src_agent, to dst, owned by
+ * dst_agent, on a DMA engine through hsa_amd_memory_async_copy: host to
+ * device, device to host or between two GPUs. The copy starts once every
+ * signal in deps is 0 and decrements completion by 1 when it is done; the
+ * calling thread does not wait for either. A peer copy needs the source
+ * agent to have been given access to the destination buffer with
+ * MemoryPool::allow_access().
+ */
+void copy_async(void* dst, hsa_agent_t dst_agent, const void* src, hsa_agent_t src_agent, size_t size,
+                const std::vector<hsa_signal_t>& deps, hsa_signal_t completion);
+
+/*
+ * A graph of kernel dispatches and asynchronous copies that may span the
+ * queues and DMA engines of several agents. Each node lists the earlier
+ * nodes whose output it reads, and the dependencies are resolved on the
+ * devices, not by the host: a dependency of a dispatch on a copy or on a
+ * node of another queue becomes a barrier-AND packet in front of the
+ * node's dispatch packet, carrying the producer's completion signal, a
+ * dependency on the same queue sets the dispatch packet's barrier bit, and
+ * the dependencies of a copy are passed to copy_async(). submit() enqueues
+ * the whole graph up front in the order the nodes were added, so one stage
+ * starts as soon as the previous one ends, without a host round trip in
+ * between. Copy completion signals come from a pool the graph keeps for
+ * its lifetime; copies sizes it up front, and a graph reused through
+ * clear() creates no signals once the pool is large enough.
+ */
+class TaskGraph {
+public:
+    typedef size_t Node;
+
+    explicit TaskGraph(uint32_t copies = 0);
+    ~TaskGraph();
+
+    Node add(Queue& queue, const Kernel& kernel, const Grid& grid, const void* args, size_t args_size,
+             const std::vector<Node>& deps = std::vector<Node>());
+
+    template <class Args>
+    Node add(Queue& queue, const Kernel& kernel, const Grid& grid, const Args& args,
+             const std::vector<Node>& deps = std::vector<Node>()) {
+        return add(queue, kernel, grid, &args, sizeof(args), deps);
+    }
+
+    Node add_copy(void* dst, hsa_agent_t dst_agent, const void* src, hsa_agent_t src_agent, size_t size,
+                  const std::vector<Node>& deps = std::vector<Node>());
+
+    /*
+     * Enqueues every node. A graph may be submitted again to run it once
+     * more; if the previous round has not been waited for, submit() waits
+     * for it first.
+     */
+    void submit();
+
+    /*
+     * Blocks until every node has completed, then releases their signals
+     * and kernarg buffers.
+     */
+    void wait(WaitMode mode = WAIT_BLOCKED);
+
+    /*
+     * Removes every node, waiting for a submitted graph first, so the
+     * graph can be built again on the same copy signal pool.
+     */
+    void clear();
+
+    /* Barrier-AND packets written by submit(). */
+    uint64_t barriers;
+
+private:
+    TaskGraph(const TaskGraph&);
+    TaskGraph& operator=(const TaskGraph&);
+
+    /*
+     * A dispatch, or a copy if kernel is NULL. A copy's dispatch has no
+     * queue or kernarg, only the completion signal from copy_signals.
+     */
+    struct Task {
+        Task(Queue& q, const Kernel& k, const Grid& g)
+            : queue(&q), kernel(&k), grid(g), dst(NULL), dst_agent(), src(NULL), src_agent(), size(0), dispatch() {}
+        Task()
+            : queue(NULL), kernel(NULL), grid(1, 1), dst(NULL), dst_agent(), src(NULL), src_agent(), size(0), dispatch() {}
+
+        Queue* queue;
+        const Kernel* kernel;
+        Grid grid;
+        std::vector<char> args;
+        void* dst;
+        hsa_agent_t dst_agent;
+        const void* src;
+        hsa_agent_t src_agent;
+        size_t size;
+        std::vector<Node> deps;
+        Dispatch dispatch;
+    };
+
+    std::vector<Task> tasks;
+    SignalPool* copy_signals;
+    bool submitted;
+};
+
+#endif
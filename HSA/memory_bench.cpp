@@ -0,0 +1,137 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "hsa_dispatch.h"
+
+#define COPY_ELEMS (1024*1024)
+#define COPY_BYTES (COPY_ELEMS*4)
+#define COPY_WORKGROUP 256
+
+/*
+ * Buffer placement benchmark: runs the vector_copy kernel on the 4 MB
+ * buffers of vector_copy.c once with device-local buffers staged by
+ * explicit copies and once with zero-copy buffers in fine-grained system
+ * memory. Each repetition allocates the buffers from a MemoryPool,
+ * uploads the input, runs the kernel a number of times, downloads the
+ * output, validates it and releases the buffers; staging and kernel time
+ * are reported separately, so the cost of the copies can be weighed
+ * against the faster kernel.
+ *
+ * Usage: memory_bench <vector_copy.brig> [dispatches per repetition] [repetitions]
+ */
+
+struct __attribute__ ((aligned(16))) args_t {
+    void* in;
+    void* out;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <vector_copy.brig> [dispatches per repetition] [repetitions]\n", argv[0]);
+        return 1;
+    }
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 0) : 10;
+    size_t repeat = argc > 3 ? strtoul(argv[3], NULL, 0) : 5;
+    if (count == 0 || repeat == 0) {
+        printf("Usage: %s <vector_copy.brig> [dispatches per repetition] [repetitions]\n", argv[0]);
+        return 1;
+    }
+
+    Runtime runtime;
+    std::vector<Agent> agents = Agent::gpus();
+    if (agents.empty()) {
+        printf("No GPU agent found.\n");
+        return 1;
+    }
+    Program program(runtime, argv[1]);
+    Queue queue(agents[0]);
+    Executable executable(program, agents[0]);
+    Kernel kernel(executable, "&__vector_copy_kernel");
+    Grid grid(COPY_ELEMS, COPY_WORKGROUP);
+    printf("Agent %s, %zu repetitions of %zu dispatches on %d bytes\n", agents[0].name, repeat, count, COPY_BYTES);
+
+    char* host_in = (char*)malloc(COPY_BYTES);
+    char* host_out = (char*)malloc(COPY_BYTES);
+    int valid = 1;
+    MemoryMode modes[2] = {MEMORY_DEVICE_LOCAL, MEMORY_ZERO_COPY};
+    for (int m = 0; m < 2; m++) {
+        MemoryPool pool(agents[0], modes[m]);
+        if (pool.mode != modes[m]) {
+            printf("%-12s not available on this agent\n", memory_mode_name(modes[m]));
+            continue;
+        }
+
+        double staging_sec = 0;
+        double kernel_sec = 0;
+        for (size_t r = 0; r < repeat; r++) {
+            memset(host_in, (int)(r + 1), COPY_BYTES);
+            memset(host_out, 0, COPY_BYTES);
+            args_t args;
+            args.in = pool.allocate(COPY_BYTES);
+            args.out = pool.allocate(COPY_BYTES);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            pool.upload(args.in, host_in, COPY_BYTES);
+            staging_sec += seconds_since(start);
+
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < count; i++) {
+                Dispatch d = dispatch(queue, kernel, grid, args);
+                wait(d);
+            }
+            kernel_sec += seconds_since(start);
+
+            start = std::chrono::steady_clock::now();
+            pool.download(host_out, args.out, COPY_BYTES);
+            staging_sec += seconds_since(start);
+
+            if (memcmp(host_in, host_out, COPY_BYTES) != 0) {
+                printf("VALIDATION FAILED for %s buffers!\n", memory_mode_name(pool.mode));
+                valid = 0;
+            }
+            pool.release(args.in);
+            pool.release(args.out);
+        }
+
+        double per_dispatch = kernel_sec / (repeat * count);
+        printf("%-12s kernel %8.3f ms (%6.2f GB/s)  staging %8.3f ms per repetition  total %8.3f ms  %llu allocations\n",
+               memory_mode_name(pool.mode), per_dispatch * 1e3, 2.0 * COPY_BYTES / per_dispatch / 1e9,
+               staging_sec / repeat * 1e3, (kernel_sec + staging_sec) / repeat * 1e3,
+               (unsigned long long)pool.allocations);
+    }
+    if (valid) {
+        printf("Passed validation.\n");
+    }
+
+    free(host_in);
+    free(host_out);
+    return valid ? 0 : 1;
+}
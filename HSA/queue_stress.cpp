@@ -0,0 +1,200 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "aql_queue.h"
+
+/*
+ * Stress test of the multi-producer AQL writer in aql_queue.h. Many host
+ * threads submit to one HSA_QUEUE_TYPE_MULTI queue while a consumer thread
+ * plays packet processor. The queue is a software stand-in: this file
+ * implements the few hsa_queue_* and doorbell calls the writer uses, so the
+ * test needs neither a GPU nor the runtime library.
+ *
+ * Every packet carries its producer and a per-producer sequence number. The
+ * consumer checks that each producer's packets arrive complete, exactly once
+ * and in order, which catches lost or overlapping slot reservations and
+ * headers published before their bodies.
+ *
+ * Usage: queue_stress [producers] [packets per producer] [queue size] [batch size]
+ */
+
+struct SoftQueue {
+    hsa_queue_t queue;
+    std::atomic<uint64_t> write_index;
+    std::atomic<uint64_t> read_index;
+    std::atomic<hsa_signal_value_t> doorbell;
+};
+
+static SoftQueue* soft(const hsa_queue_t* queue) {
+    return (SoftQueue*)queue;
+}
+
+uint64_t hsa_queue_load_read_index_acquire(const hsa_queue_t* queue) {
+    return soft(queue)->read_index.load(std::memory_order_acquire);
+}
+
+uint64_t hsa_queue_load_write_index_relaxed(const hsa_queue_t* queue) {
+    return soft(queue)->write_index.load(std::memory_order_relaxed);
+}
+
+void hsa_queue_store_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    soft(queue)->write_index.store(value, std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_add_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    return soft(queue)->write_index.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t hsa_queue_cas_write_index_relaxed(const hsa_queue_t* queue, uint64_t expected, uint64_t value) {
+    soft(queue)->write_index.compare_exchange_strong(expected, value, std::memory_order_relaxed);
+    return expected;
+}
+
+void hsa_signal_store_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
+    ((std::atomic<hsa_signal_value_t>*)signal.handle)->store(value, std::memory_order_relaxed);
+}
+
+/*
+ * Submits count packets in batches. Every third batch goes through
+ * aql_try_reserve() so both reservation paths race against each other.
+ */
+static void produce(hsa_queue_t* queue, uint32_t producer, uint32_t count, uint32_t batch) {
+    uint32_t seq = 0;
+    for (uint32_t round = 0; seq < count; round++) {
+        uint32_t n = (count - seq < batch) ? count - seq : batch;
+        uint64_t index;
+        if (round % 3 == 2) {
+            while (!aql_try_reserve(queue, n, &index)) {
+                std::this_thread::yield();
+            }
+        } else {
+            index = aql_reserve(queue, n);
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            hsa_kernel_dispatch_packet_t* dispatch_packet = aql_packet(queue, index + i);
+            dispatch_packet->setup = 1 << HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS;
+            dispatch_packet->grid_size_x = producer;
+            dispatch_packet->grid_size_y = seq + i;
+            dispatch_packet->grid_size_z = 1;
+        }
+        for (uint32_t i = n; i > 0; i--) {
+            aql_publish(aql_packet(queue, index + i - 1));
+        }
+        aql_ring(queue, index + n - 1);
+        seq += n;
+    }
+}
+
+/*
+ * The packet processor: consumes packets in ring order, validates them and
+ * hands their slots back by invalidating the header and bumping the read
+ * index. Returns the number of packets that arrived out of sequence.
+ */
+static uint64_t consume(SoftQueue* sq, uint32_t producers, uint64_t total) {
+    hsa_queue_t* queue = &sq->queue;
+    std::vector<uint32_t> next(producers, 0);
+    uint64_t errors = 0;
+
+    for (uint64_t read = 0; read < total; read++) {
+        hsa_kernel_dispatch_packet_t* dispatch_packet = aql_packet(queue, read);
+        uint16_t header;
+        while (((header = __atomic_load_n(&dispatch_packet->header, __ATOMIC_ACQUIRE)) & 0xff) == HSA_PACKET_TYPE_INVALID) {
+            std::this_thread::yield();
+        }
+
+        uint32_t producer = dispatch_packet->grid_size_x;
+        if (producer >= producers || dispatch_packet->grid_size_y != next[producer]) {
+            if (errors++ < 10) {
+                printf("Bad packet at index %llu: producer %u, sequence %u\n",
+                       (unsigned long long)read, producer, dispatch_packet->grid_size_y);
+            }
+        } else {
+            next[producer]++;
+        }
+
+        __atomic_store_n(&dispatch_packet->header, (uint16_t)(HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE), __ATOMIC_RELEASE);
+        sq->read_index.store(read + 1, std::memory_order_release);
+    }
+    return errors;
+}
+
+int main(int argc, char **argv) {
+    uint32_t producers = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+    uint32_t count = argc > 2 ? strtoul(argv[2], NULL, 0) : 10000;
+    uint32_t size = argc > 3 ? strtoul(argv[3], NULL, 0) : 256;
+    uint32_t batch = argc > 4 ? strtoul(argv[4], NULL, 0) : 4;
+    if (producers == 0 || size == 0 || (size & (size - 1)) != 0 || batch == 0 || batch > size) {
+        printf("Usage: %s [producers] [packets per producer] [queue size, power of two] [batch size <= queue size]\n", argv[0]);
+        return 1;
+    }
+    printf("%u producers, %u packets each, queue size %u, batch size %u\n", producers, count, size, batch);
+
+    SoftQueue sq;
+    std::vector<hsa_kernel_dispatch_packet_t> ring(size);
+    memset(&ring[0], 0, size * sizeof(hsa_kernel_dispatch_packet_t));
+    for (uint32_t i = 0; i < size; i++) {
+        ring[i].header = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    }
+    memset(&sq.queue, 0, sizeof(sq.queue));
+    sq.queue.type = HSA_QUEUE_TYPE_MULTI;
+    sq.queue.base_address = &ring[0];
+    sq.queue.size = size;
+    sq.queue.doorbell_signal.handle = (uint64_t)&sq.doorbell;
+    sq.write_index = 0;
+    sq.read_index = 0;
+    sq.doorbell = -1;
+
+    uint64_t total = (uint64_t)producers * count;
+    uint64_t errors = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::thread consumer([&] { errors = consume(&sq, producers, total); });
+    std::vector<std::thread> threads;
+    for (uint32_t p = 0; p < producers; p++) {
+        threads.push_back(std::thread(produce, &sq.queue, p, count, batch));
+    }
+    for (uint32_t p = 0; p < producers; p++) {
+        threads[p].join();
+    }
+    consumer.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (sq.write_index != total || sq.read_index != total) {
+        printf("Index mismatch: write %llu, read %llu, expected %llu\n", (unsigned long long)sq.write_index.load(),
+               (unsigned long long)sq.read_index.load(), (unsigned long long)total);
+        errors++;
+    }
+    printf("%llu packets in %.3f s, %.0f packets/s\n", (unsigned long long)total, sec, total / sec);
+    if (errors) {
+        printf("VALIDATION FAILED!\n%llu bad packets\n", (unsigned long long)errors);
+        return 1;
+    }
+    printf("Passed validation.\n");
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "hsa_dispatch.h"
+#include "soft_hsa.h"
+
+/*
+ * Workgroup scheduling benchmark for the software runtime: runs a uniform
+ * and a skewed kernel over the 1024*1024 grid of vector_copy.c with the
+ * static and the work-stealing schedule and reports the time per dispatch.
+ * In the skewed kernel the first eighth of the workgroups does
+ * SKEW_FACTOR times the work of the rest, which with a static split all
+ * lands on the first workers.
+ *
+ * Usage: schedule_bench <vector_copy.brig> [dispatches] [iterations per work-item]
+ */
+
+#define BENCH_GRID (1024 * 1024)
+#define BENCH_WORKGROUP 256
+#define SKEW_FACTOR 16
+
+struct __attribute__ ((aligned(16))) args_t {
+    uint32_t* out;
+    uint32_t iterations;
+};
+
+static uint32_t work_item(uint32_t id, uint32_t iterations) {
+    uint32_t x = id;
+    for (uint32_t i = 0; i < iterations; i++) {
+        x = x * 1664525u + 1013904223u;
+    }
+    return x;
+}
+
+static bool skewed_group(uint32_t group, uint32_t groups) {
+    return group < groups / 8;
+}
+
+static uint32_t work_item_iterations(bool skewed, uint32_t id, uint32_t iterations) {
+    uint32_t groups = BENCH_GRID / BENCH_WORKGROUP;
+    return skewed && skewed_group(id / BENCH_WORKGROUP, groups) ? iterations * SKEW_FACTOR : iterations;
+}
+
+static void run_workgroup(const void* kernarg, const soft_workgroup_t* workgroup, bool skewed) {
+    const args_t* args = (const args_t*)kernarg;
+    uint32_t groups = (workgroup->grid_size[0] + workgroup->workgroup_size[0] - 1) / workgroup->workgroup_size[0];
+    uint32_t iterations = args->iterations;
+    if (skewed && skewed_group(workgroup->group_id[0], groups)) {
+        iterations *= SKEW_FACTOR;
+    }
+    uint32_t first = workgroup->group_id[0] * workgroup->workgroup_size[0];
+    uint32_t last = first + workgroup->workgroup_size[0];
+    if (last > workgroup->grid_size[0]) {
+        last = workgroup->grid_size[0];
+    }
+    for (uint32_t i = first; i < last; i++) {
+        args->out[i] = work_item(i, iterations);
+    }
+}
+
+static void uniform_kernel(const void* kernarg, const soft_workgroup_t* workgroup) {
+    run_workgroup(kernarg, workgroup, false);
+}
+
+static void skewed_kernel(const void* kernarg, const soft_workgroup_t* workgroup) {
+    run_workgroup(kernarg, workgroup, true);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double run(Queue& queue, const Kernel& kernel, const args_t& args, size_t count) {
+    Grid grid(BENCH_GRID, BENCH_WORKGROUP);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        Dispatch d = dispatch(queue, kernel, grid, args);
+        wait(d);
+    }
+    return seconds_since(start) / count;
+}
+
+static bool validate(const args_t& args, bool skewed) {
+    for (uint32_t i = 0; i < BENCH_GRID; i++) {
+        if (args.out[i] != work_item(i, work_item_iterations(skewed, i, args.iterations))) {
+            printf("VALIDATION FAILED!\nBad index: %u\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 0) : 10;
+    uint32_t iterations = argc > 3 ? strtoul(argv[3], NULL, 0) : 64;
+    if (argc < 2 || count == 0) {
+        printf("Usage: %s <vector_copy.brig> [dispatches] [iterations per work-item]\n", argv[0]);
+        return 1;
+    }
+
+    soft_hsa_register_kernel("&uniform_kernel", uniform_kernel, sizeof(args_t));
+    soft_hsa_register_kernel("&skewed_kernel", skewed_kernel, sizeof(args_t));
+
+    Runtime runtime;
+    std::vector<Agent> agents = Agent::gpus();
+    if (agents.empty()) {
+        printf("No GPU agent found.\n");
+        return 1;
+    }
+    Program program(runtime, argv[1]);
+    Queue queue(agents[0]);
+    Executable executable(program, agents[0]);
+    Kernel kernels[2] = {Kernel(executable, "&uniform_kernel"), Kernel(executable, "&skewed_kernel")};
+    const char* names[2] = {"uniform", "skewed"};
+
+    args_t args;
+    args.out = (uint32_t*)malloc(BENCH_GRID * 4);
+    args.iterations = iterations;
+    hsa_check(hsa_memory_register(args.out, BENCH_GRID * 4), "Registering argument memory for output parameter");
+    printf("Agent %s, %zu dispatches of %d work-items in workgroups of %d, %u iterations per work-item\n",
+           agents[0].name, count, BENCH_GRID, BENCH_WORKGROUP, iterations);
+
+    bool valid = true;
+    for (int k = 0; k < 2; k++) {
+        soft_hsa_set_schedule(SOFT_SCHEDULE_STATIC);
+        double static_sec = run(queue, kernels[k], args, count);
+        valid = validate(args, k == 1) && valid;
+        soft_hsa_set_schedule(SOFT_SCHEDULE_STEALING);
+        double stealing_sec = run(queue, kernels[k], args, count);
+        valid = validate(args, k == 1) && valid;
+        printf("%-8s static %8.3f ms  stealing %8.3f ms  speedup %.2fx\n", names[k], static_sec * 1e3,
+               stealing_sec * 1e3, static_sec / stealing_sec);
+    }
+    if (valid) {
+        printf("Passed validation.\n");
+    }
+
+    hsa_memory_deregister(args.out, BENCH_GRID * 4);
+    free(args.out);
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,1301 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "/p/hal/private/rocm/hsa/include/hsa/hsa.h"
+#include "/p/hal/private/rocm/hsa/include/hsa/hsa_ext_finalize.h"
+#include "/p/hal/private/rocm/hsa/include/hsa/hsa_ext_amd.h"
+#include "soft_hsa.h"
+
+#define SOFT_DEFAULT_AGENTS 2
+#define SOFT_QUEUE_MIN_SIZE 64
+#define SOFT_QUEUE_MAX_SIZE 4096
+#define SOFT_WORKGROUP_MAX_SIZE 1024
+#define SOFT_REGION_SYSTEM 1
+#define SOFT_REGION_LOCAL 2
+#define SOFT_REGION_SIZE (1ULL << 36)
+#define SOFT_ALLOC_GRANULE 4096
+#define SOFT_ISA 1
+#define SOFT_ISA_NAME "SOFT:HSA:1:0:0"
+#define SOFT_CODE_OBJECT_MAGIC "SOFTHSA1"
+
+/*
+ * Signals. The value is an atomic; waiters sleep on a condition variable
+ * that every change notifies, but only when somebody is waiting, so the
+ * common store with no waiter is a single atomic. hsa_amd_signal_wait_any
+ * cannot sleep on several condition variables, so its callers sleep on
+ * one shared by all signals, which every change notifies while any of
+ * them waits.
+ */
+struct SoftSignal {
+    std::atomic<hsa_signal_value_t> value;
+    std::atomic<int> waiters;
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+static SoftSignal* soft_signal(hsa_signal_t signal) {
+    return (SoftSignal*)signal.handle;
+}
+
+static std::atomic<int> any_waiters(0);
+static std::mutex any_lock;
+static std::condition_variable any_changed;
+
+static void signal_changed(SoftSignal* s) {
+    if (s->waiters.load() > 0) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->changed.notify_all();
+    }
+    if (any_waiters.load() > 0) {
+        std::lock_guard<std::mutex> guard(any_lock);
+        any_changed.notify_all();
+    }
+}
+
+static bool signal_satisfied(hsa_signal_condition_t condition, hsa_signal_value_t value, hsa_signal_value_t compare) {
+    switch (condition) {
+    case HSA_SIGNAL_CONDITION_EQ: return value == compare;
+    case HSA_SIGNAL_CONDITION_NE: return value != compare;
+    case HSA_SIGNAL_CONDITION_LT: return value < compare;
+    case HSA_SIGNAL_CONDITION_GTE: return value >= compare;
+    }
+    return true;
+}
+
+/*
+ * Agents, regions and the ISA. Agent 0 is a CPU agent without kernel
+ * dispatch, as on a real system; the rest are GPU agents.
+ */
+class DmaEngine;
+
+struct SoftAgent {
+    hsa_device_type_t device;
+    char name[64];
+    uint32_t node;
+    DmaEngine* dma_in;
+    DmaEngine* dma_out;
+};
+
+/*
+ * Kernels registered by name. Entries live for the whole process; the
+ * kernel object of a dispatch is a pointer to one.
+ */
+struct SoftKernel {
+    std::string name;
+    soft_kernel_t fn;
+    uint32_t kernarg_segment_size;
+};
+
+static void vector_copy_kernel(const void* kernarg, const soft_workgroup_t* workgroup) {
+    const uint32_t* in = ((const uint32_t* const*)kernarg)[0];
+    uint32_t* out = ((uint32_t* const*)kernarg)[1];
+    uint32_t first = workgroup->group_id[0] * workgroup->workgroup_size[0];
+    uint32_t last = first + workgroup->workgroup_size[0];
+    if (last > workgroup->grid_size[0]) {
+        last = workgroup->grid_size[0];
+    }
+    for (uint32_t i = first; i < last; i++) {
+        out[i] = in[i];
+    }
+}
+
+static std::mutex& registry_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+static std::map<std::string, SoftKernel*>& registry() {
+    static std::map<std::string, SoftKernel*> kernels;
+    if (kernels.empty()) {
+        kernels["&__vector_copy_kernel"] = new SoftKernel{"&__vector_copy_kernel", vector_copy_kernel, 16};
+    }
+    return kernels;
+}
+
+void soft_hsa_register_kernel(const char* name, soft_kernel_t fn, uint32_t kernarg_segment_size) {
+    std::lock_guard<std::mutex> guard(registry_lock());
+    SoftKernel*& kernel = registry()[name];
+    if (kernel == NULL) {
+        kernel = new SoftKernel;
+    }
+    kernel->name = name;
+    kernel->fn = fn;
+    kernel->kernarg_segment_size = kernarg_segment_size;
+}
+
+/*
+ * Worker pool that runs the workgroups of a dispatch. run() splits the
+ * workgroups into one contiguous range per worker plus one for the
+ * calling packet processor, and returns once every range is done. Several
+ * queues may call run() at once; their ranges share the task queue.
+ *
+ * With SOFT_SCHEDULE_STATIC each participant runs exactly its own range,
+ * so one slow range holds up the whole dispatch. With
+ * SOFT_SCHEDULE_STEALING each range is the initial content of that
+ * participant's deque: the owner halves the range at the front until a
+ * piece is at most SOFT_STEAL_GRAIN workgroups, pushing the upper halves
+ * back, and runs the pieces front to back; a participant whose deque is
+ * empty takes the range at the back of another's deque, which is the
+ * largest one left there, and splits it in its own deque the same way.
+ */
+#define SOFT_STEAL_GRAIN 4
+
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned count) : stopping(false) {
+        for (unsigned i = 0; i < count; i++) {
+            threads.push_back(std::thread(&WorkerPool::work, this));
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+    }
+
+    void run(uint64_t count, soft_schedule_t schedule, const std::function<void(uint64_t)>& fn) {
+        Job job;
+        job.fn = &fn;
+        job.schedule = schedule;
+        job.parts = threads.size() + 1;
+        job.remaining = job.parts - 1;
+        job.deques.reset(new WorkDeque[job.parts]);
+        for (uint64_t part = 0; part < job.parts; part++) {
+            Range range = {count * part / job.parts, count * (part + 1) / job.parts};
+            if (range.first < range.last) {
+                job.deques[part].ranges.push_back(range);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (uint64_t part = 1; part < job.parts; part++) {
+                tasks.push_back(Task(&job, part));
+            }
+        }
+        wake.notify_all();
+
+        run_part(&job, 0);
+        std::unique_lock<std::mutex> guard(job.lock);
+        job.done.wait(guard, [&] { return job.remaining == 0; });
+    }
+
+private:
+    /*
+     * Workgroups [first, last).
+     */
+    struct Range {
+        uint64_t first;
+        uint64_t last;
+    };
+
+    struct WorkDeque {
+        std::mutex lock;
+        std::deque<Range> ranges;
+    };
+
+    struct Job {
+        const std::function<void(uint64_t)>* fn;
+        soft_schedule_t schedule;
+        uint64_t parts;
+        uint64_t remaining;
+        std::unique_ptr<WorkDeque[]> deques;
+        std::mutex lock;
+        std::condition_variable done;
+    };
+    typedef std::pair<Job*, uint64_t> Task;
+
+    static bool take_front(WorkDeque& deque, Range& range) {
+        std::lock_guard<std::mutex> guard(deque.lock);
+        if (deque.ranges.empty()) {
+            return false;
+        }
+        range = deque.ranges.front();
+        deque.ranges.pop_front();
+        return true;
+    }
+
+    static bool steal(Job* job, uint64_t thief, Range& range) {
+        for (uint64_t i = 1; i < job->parts; i++) {
+            WorkDeque& victim = job->deques[(thief + i) % job->parts];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.ranges.empty()) {
+                range = victim.ranges.back();
+                victim.ranges.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void run_part(Job* job, uint64_t part) {
+        WorkDeque& own = job->deques[part];
+        Range range;
+        if (job->schedule == SOFT_SCHEDULE_STATIC) {
+            if (take_front(own, range)) {
+                for (uint64_t i = range.first; i < range.last; i++) {
+                    (*job->fn)(i);
+                }
+            }
+            return;
+        }
+
+        while (take_front(own, range) || steal(job, part, range)) {
+            while (range.last - range.first > SOFT_STEAL_GRAIN) {
+                Range upper = {range.first + (range.last - range.first) / 2, range.last};
+                range.last = upper.first;
+                std::lock_guard<std::mutex> guard(own.lock);
+                own.ranges.push_front(upper);
+            }
+            for (uint64_t i = range.first; i < range.last; i++) {
+                (*job->fn)(i);
+            }
+        }
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            Task task = tasks.front();
+            tasks.pop_front();
+            guard.unlock();
+
+            run_part(task.first, task.second);
+            {
+                std::lock_guard<std::mutex> job_guard(task.first->lock);
+                if (--task.first->remaining == 0) {
+                    task.first->done.notify_one();
+                }
+            }
+            guard.lock();
+        }
+    }
+
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Task> tasks;
+    std::vector<std::thread> threads;
+};
+
+/*
+ * A DMA engine. Every agent has two, one for copies into it and one for
+ * copies out of it, so a download waiting for a kernel does not hold up
+ * the upload for the next one. Copies queued by hsa_amd_memory_async_copy
+ * run in order on the engine's thread, each once all its dependency
+ * signals are 0, and decrement their completion signal when done. Every
+ * region is host memory here, so a copy is a memcpy, but it runs beside
+ * the kernels of the same agent, as on a GPU whose DMA engines work while
+ * its compute units do. The destructor finishes every queued copy.
+ */
+class DmaEngine {
+public:
+    DmaEngine() : stopping(false) {
+        thread = std::thread(&DmaEngine::run, this);
+    }
+
+    ~DmaEngine() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+
+    void copy(void* dst, const void* src, size_t size, uint32_t num_deps, const hsa_signal_t* deps,
+              hsa_signal_t completion) {
+        Copy c;
+        c.dst = dst;
+        c.src = src;
+        c.size = size;
+        c.deps.assign(deps, deps + num_deps);
+        c.completion = completion;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            copies.push_back(c);
+        }
+        wake.notify_one();
+    }
+
+private:
+    struct Copy {
+        void* dst;
+        const void* src;
+        size_t size;
+        std::vector<hsa_signal_t> deps;
+        hsa_signal_t completion;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [this] { return stopping || !copies.empty(); });
+            if (copies.empty()) {
+                return;
+            }
+            Copy c = copies.front();
+            copies.pop_front();
+            guard.unlock();
+
+            for (size_t i = 0; i < c.deps.size(); i++) {
+                hsa_signal_wait_acquire(c.deps[i], HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
+            }
+            memcpy(c.dst, c.src, c.size);
+            hsa_signal_subtract_release(c.completion, 1);
+            guard.lock();
+        }
+    }
+
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<Copy> copies;
+    std::thread thread;
+};
+
+/*
+ * An AQL queue: the hsa_queue_t the application sees, the indices the API
+ * hides, and the packet-processor thread.
+ */
+struct SoftQueue {
+    hsa_queue_t queue;
+    std::atomic<uint64_t> write_index;
+    std::atomic<uint64_t> read_index;
+    SoftSignal* doorbell;
+    std::atomic<bool> stopping;
+    std::thread processor;
+};
+
+static SoftQueue* soft_queue(const hsa_queue_t* queue) {
+    return (SoftQueue*)queue;
+}
+
+/*
+ * Runtime state between hsa_init and the matching hsa_shut_down.
+ */
+static std::mutex runtime_lock;
+static int runtime_refs = 0;
+static std::vector<SoftAgent*> agents;
+static WorkerPool* workers = NULL;
+static std::atomic<int> schedule(SOFT_SCHEDULE_STEALING);
+static uint64_t next_queue_id = 0;
+
+void soft_hsa_set_schedule(soft_schedule_t value) {
+    schedule = value;
+}
+
+static unsigned env_count(const char* name, unsigned fallback) {
+    const char* value = getenv(name);
+    if (value == NULL || atoi(value) <= 0) {
+        return fallback;
+    }
+    return (unsigned)atoi(value);
+}
+
+static SoftAgent* soft_agent(hsa_agent_t agent) {
+    for (size_t i = 0; i < agents.size(); i++) {
+        if ((uint64_t)agents[i] == agent.handle) {
+            return agents[i];
+        }
+    }
+    return NULL;
+}
+
+hsa_status_t HSA_API hsa_init() {
+    std::lock_guard<std::mutex> guard(runtime_lock);
+    if (runtime_refs++ > 0) {
+        return HSA_STATUS_SUCCESS;
+    }
+
+    SoftAgent* cpu = new SoftAgent;
+    cpu->device = HSA_DEVICE_TYPE_CPU;
+    snprintf(cpu->name, sizeof(cpu->name), "soft-cpu");
+    cpu->node = 0;
+    cpu->dma_in = new DmaEngine;
+    cpu->dma_out = new DmaEngine;
+    agents.push_back(cpu);
+    unsigned gpus = env_count("SOFT_HSA_AGENTS", SOFT_DEFAULT_AGENTS);
+    for (unsigned i = 0; i < gpus; i++) {
+        SoftAgent* gpu = new SoftAgent;
+        gpu->device = HSA_DEVICE_TYPE_GPU;
+        snprintf(gpu->name, sizeof(gpu->name), "soft-gpu%u", i);
+        gpu->node = i + 1;
+        gpu->dma_in = new DmaEngine;
+        gpu->dma_out = new DmaEngine;
+        agents.push_back(gpu);
+    }
+
+    unsigned cores = std::thread::hardware_concurrency();
+    workers = new WorkerPool(env_count("SOFT_HSA_THREADS", cores > 0 ? cores : 1) - 1);
+    const char* name = getenv("SOFT_HSA_SCHEDULE");
+    if (name != NULL) {
+        schedule = strcmp(name, "static") == 0 ? SOFT_SCHEDULE_STATIC : SOFT_SCHEDULE_STEALING;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_shut_down() {
+    std::lock_guard<std::mutex> guard(runtime_lock);
+    if (runtime_refs == 0) {
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    }
+    if (--runtime_refs > 0) {
+        return HSA_STATUS_SUCCESS;
+    }
+    delete workers;
+    workers = NULL;
+    for (size_t i = 0; i < agents.size(); i++) {
+        delete agents[i]->dma_in;
+        delete agents[i]->dma_out;
+        delete agents[i];
+    }
+    agents.clear();
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_status_string(hsa_status_t status, const char** status_string) {
+    switch (status) {
+    case HSA_STATUS_SUCCESS: *status_string = "HSA_STATUS_SUCCESS: The function has been executed successfully."; break;
+    case HSA_STATUS_INFO_BREAK: *status_string = "HSA_STATUS_INFO_BREAK: A traversal over a list of elements has been interrupted."; break;
+    case HSA_STATUS_ERROR_INVALID_ARGUMENT: *status_string = "HSA_STATUS_ERROR_INVALID_ARGUMENT: One of the actual arguments does not meet a precondition."; break;
+    case HSA_STATUS_ERROR_INVALID_AGENT: *status_string = "HSA_STATUS_ERROR_INVALID_AGENT: The agent is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_REGION: *status_string = "HSA_STATUS_ERROR_INVALID_REGION: The memory region is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_CODE_OBJECT: *status_string = "HSA_STATUS_ERROR_INVALID_CODE_OBJECT: The code object is invalid."; break;
+    case HSA_STATUS_ERROR_INVALID_SYMBOL_NAME: *status_string = "HSA_STATUS_ERROR_INVALID_SYMBOL_NAME: There is no symbol with the given name."; break;
+    case HSA_STATUS_ERROR_OUT_OF_RESOURCES: *status_string = "HSA_STATUS_ERROR_OUT_OF_RESOURCES: The runtime failed to allocate the necessary resources."; break;
+    case HSA_STATUS_ERROR_NOT_INITIALIZED: *status_string = "HSA_STATUS_ERROR_NOT_INITIALIZED: The runtime has not been initialized."; break;
+    default: *status_string = "HSA_STATUS_ERROR: A generic error has occurred."; break;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+static uint64_t timestamp() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+hsa_status_t HSA_API hsa_system_get_info(hsa_system_info_t attribute, void* value) {
+    switch (attribute) {
+    case HSA_SYSTEM_INFO_VERSION_MAJOR: *(uint16_t*)value = 1; break;
+    case HSA_SYSTEM_INFO_VERSION_MINOR: *(uint16_t*)value = 0; break;
+    case HSA_SYSTEM_INFO_TIMESTAMP: *(uint64_t*)value = timestamp(); break;
+    case HSA_SYSTEM_INFO_TIMESTAMP_FREQUENCY: *(uint64_t*)value = 1000000000ULL; break;
+    case HSA_SYSTEM_INFO_SIGNAL_MAX_WAIT: *(uint64_t*)value = UINT64_MAX; break;
+    case HSA_SYSTEM_INFO_ENDIANNESS: *(hsa_endianness_t*)value = HSA_ENDIANNESS_LITTLE; break;
+    case HSA_SYSTEM_INFO_MACHINE_MODEL: *(hsa_machine_model_t*)value = HSA_MACHINE_MODEL_LARGE; break;
+    case HSA_SYSTEM_INFO_EXTENSIONS:
+        memset(value, 0, 128);
+        ((uint8_t*)value)[0] = 1 << HSA_EXTENSION_FINALIZER;
+        break;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Finalizer extension. Programs only remember their modules; finalizing
+ * one yields a code object that stands for "every registered kernel".
+ */
+struct SoftProgram {
+    std::vector<hsa_ext_module_t> modules;
+};
+
+struct SoftCodeObject {
+    hsa_isa_t isa;
+};
+
+static hsa_status_t soft_program_create(hsa_machine_model_t machine_model, hsa_profile_t profile,
+                                        hsa_default_float_rounding_mode_t rounding_mode, const char* options,
+                                        hsa_ext_program_t* program) {
+    program->handle = (uint64_t)new SoftProgram;
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t soft_program_destroy(hsa_ext_program_t program) {
+    delete (SoftProgram*)program.handle;
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t soft_program_add_module(hsa_ext_program_t program, hsa_ext_module_t module) {
+    if (program.handle == 0 || module == NULL) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    ((SoftProgram*)program.handle)->modules.push_back(module);
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t soft_program_iterate_modules(hsa_ext_program_t program,
+                                                 hsa_status_t (*callback)(hsa_ext_program_t program, hsa_ext_module_t module, void* data),
+                                                 void* data) {
+    std::vector<hsa_ext_module_t>& modules = ((SoftProgram*)program.handle)->modules;
+    for (size_t i = 0; i < modules.size(); i++) {
+        hsa_status_t status = callback(program, modules[i], data);
+        if (status != HSA_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t soft_program_get_info(hsa_ext_program_t program, hsa_ext_program_info_t attribute, void* value) {
+    switch (attribute) {
+    case HSA_EXT_PROGRAM_INFO_MACHINE_MODEL: *(hsa_machine_model_t*)value = HSA_MACHINE_MODEL_LARGE; break;
+    case HSA_EXT_PROGRAM_INFO_PROFILE: *(hsa_profile_t*)value = HSA_PROFILE_FULL; break;
+    case HSA_EXT_PROGRAM_INFO_DEFAULT_FLOAT_ROUNDING_MODE:
+        *(hsa_default_float_rounding_mode_t*)value = HSA_DEFAULT_FLOAT_ROUNDING_MODE_NEAR;
+        break;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+static hsa_status_t soft_program_finalize(hsa_ext_program_t program, hsa_isa_t isa, int32_t call_convention,
+                                          hsa_ext_control_directives_t control_directives, const char* options,
+                                          hsa_code_object_type_t code_object_type, hsa_code_object_t* code_object) {
+    if (program.handle == 0 || isa.handle != SOFT_ISA) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    SoftCodeObject* co = new SoftCodeObject;
+    co->isa = isa;
+    code_object->handle = (uint64_t)co;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_system_extension_supported(uint16_t extension, uint16_t version_major,
+                                                    uint16_t version_minor, bool* result) {
+    *result = extension == HSA_EXTENSION_FINALIZER && version_major == 1;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_system_get_extension_table(uint16_t extension, uint16_t version_major,
+                                                    uint16_t version_minor, void* table) {
+    if (extension != HSA_EXTENSION_FINALIZER || version_major != 1) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    hsa_ext_finalizer_1_00_pfn_t* finalizer = (hsa_ext_finalizer_1_00_pfn_t*)table;
+    finalizer->hsa_ext_program_create = soft_program_create;
+    finalizer->hsa_ext_program_destroy = soft_program_destroy;
+    finalizer->hsa_ext_program_add_module = soft_program_add_module;
+    finalizer->hsa_ext_program_iterate_modules = soft_program_iterate_modules;
+    finalizer->hsa_ext_program_get_info = soft_program_get_info;
+    finalizer->hsa_ext_program_finalize = soft_program_finalize;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_iterate_agents(hsa_status_t (*callback)(hsa_agent_t agent, void* data), void* data) {
+    if (runtime_refs == 0) {
+        return HSA_STATUS_ERROR_NOT_INITIALIZED;
+    }
+    for (size_t i = 0; i < agents.size(); i++) {
+        hsa_agent_t agent = {(uint64_t)agents[i]};
+        hsa_status_t status = callback(agent, data);
+        if (status != HSA_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_agent_get_info(hsa_agent_t agent, hsa_agent_info_t attribute, void* value) {
+    SoftAgent* a = soft_agent(agent);
+    if (a == NULL) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    bool gpu = a->device == HSA_DEVICE_TYPE_GPU;
+    switch (attribute) {
+    case HSA_AGENT_INFO_NAME: memcpy(value, a->name, sizeof(a->name)); break;
+    case HSA_AGENT_INFO_VENDOR_NAME: memset(value, 0, 64); strcpy((char*)value, "soft_hsa"); break;
+    case HSA_AGENT_INFO_FEATURE:
+        *(hsa_agent_feature_t*)value = gpu ? HSA_AGENT_FEATURE_KERNEL_DISPATCH : HSA_AGENT_FEATURE_AGENT_DISPATCH;
+        break;
+    case HSA_AGENT_INFO_MACHINE_MODEL: *(hsa_machine_model_t*)value = HSA_MACHINE_MODEL_LARGE; break;
+    case HSA_AGENT_INFO_PROFILE: *(hsa_profile_t*)value = HSA_PROFILE_FULL; break;
+    case HSA_AGENT_INFO_DEFAULT_FLOAT_ROUNDING_MODE:
+        *(hsa_default_float_rounding_mode_t*)value = HSA_DEFAULT_FLOAT_ROUNDING_MODE_NEAR;
+        break;
+    case HSA_AGENT_INFO_WAVEFRONT_SIZE: *(uint32_t*)value = gpu ? 64 : 0; break;
+    case HSA_AGENT_INFO_WORKGROUP_MAX_DIM: {
+        uint16_t* dims = (uint16_t*)value;
+        dims[0] = dims[1] = dims[2] = gpu ? SOFT_WORKGROUP_MAX_SIZE : 0;
+        break;
+    }
+    case HSA_AGENT_INFO_WORKGROUP_MAX_SIZE: *(uint32_t*)value = gpu ? SOFT_WORKGROUP_MAX_SIZE : 0; break;
+    case HSA_AGENT_INFO_GRID_MAX_SIZE: *(uint32_t*)value = gpu ? UINT32_MAX : 0; break;
+    case HSA_AGENT_INFO_FBARRIER_MAX_SIZE: *(uint32_t*)value = gpu ? 32 : 0; break;
+    case HSA_AGENT_INFO_QUEUES_MAX: *(uint32_t*)value = gpu ? 128 : 0; break;
+    case HSA_AGENT_INFO_QUEUE_MIN_SIZE: *(uint32_t*)value = gpu ? SOFT_QUEUE_MIN_SIZE : 0; break;
+    case HSA_AGENT_INFO_QUEUE_MAX_SIZE: *(uint32_t*)value = gpu ? SOFT_QUEUE_MAX_SIZE : 0; break;
+    case HSA_AGENT_INFO_QUEUE_TYPE: *(hsa_queue_type_t*)value = HSA_QUEUE_TYPE_MULTI; break;
+    case HSA_AGENT_INFO_NODE: *(uint32_t*)value = a->node; break;
+    case HSA_AGENT_INFO_DEVICE: *(hsa_device_type_t*)value = a->device; break;
+    case HSA_AGENT_INFO_ISA: ((hsa_isa_t*)value)->handle = gpu ? SOFT_ISA : 0; break;
+    case HSA_AGENT_INFO_VERSION_MAJOR: *(uint16_t*)value = 1; break;
+    case HSA_AGENT_INFO_VERSION_MINOR: *(uint16_t*)value = 0; break;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_isa_get_info(hsa_isa_t isa, hsa_isa_info_t attribute, uint32_t index, void* value) {
+    if (isa.handle != SOFT_ISA) {
+        return HSA_STATUS_ERROR_INVALID_ISA;
+    }
+    switch (attribute) {
+    case HSA_ISA_INFO_NAME_LENGTH: *(uint32_t*)value = strlen(SOFT_ISA_NAME); break;
+    case HSA_ISA_INFO_NAME: memcpy(value, SOFT_ISA_NAME, strlen(SOFT_ISA_NAME)); break;
+    case HSA_ISA_INFO_CALL_CONVENTION_COUNT: *(uint32_t*)value = 1; break;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Memory. Every agent sees a fine-grained system region that also holds
+ * kernel arguments and a coarse-grained local region; both are host
+ * memory here.
+ */
+hsa_status_t HSA_API hsa_agent_iterate_regions(hsa_agent_t agent, hsa_status_t (*callback)(hsa_region_t region, void* data),
+                                               void* data) {
+    if (soft_agent(agent) == NULL) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    hsa_region_t regions[2] = {{SOFT_REGION_SYSTEM}, {SOFT_REGION_LOCAL}};
+    for (int i = 0; i < 2; i++) {
+        hsa_status_t status = callback(regions[i], data);
+        if (status != HSA_STATUS_SUCCESS) {
+            return status;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_region_get_info(hsa_region_t region, hsa_region_info_t attribute, void* value) {
+    if (region.handle != SOFT_REGION_SYSTEM && region.handle != SOFT_REGION_LOCAL) {
+        return HSA_STATUS_ERROR_INVALID_REGION;
+    }
+    switch (attribute) {
+    case HSA_REGION_INFO_SEGMENT: *(hsa_region_segment_t*)value = HSA_REGION_SEGMENT_GLOBAL; break;
+    case HSA_REGION_INFO_GLOBAL_FLAGS:
+        *(uint32_t*)value = region.handle == SOFT_REGION_SYSTEM
+            ? HSA_REGION_GLOBAL_FLAG_KERNARG | HSA_REGION_GLOBAL_FLAG_FINE_GRAINED
+            : HSA_REGION_GLOBAL_FLAG_COARSE_GRAINED;
+        break;
+    case HSA_REGION_INFO_SIZE: *(size_t*)value = SOFT_REGION_SIZE; break;
+    case HSA_REGION_INFO_ALLOC_MAX_SIZE: *(size_t*)value = SOFT_REGION_SIZE; break;
+    case HSA_REGION_INFO_RUNTIME_ALLOC_ALLOWED: *(bool*)value = true; break;
+    case HSA_REGION_INFO_RUNTIME_ALLOC_GRANULE: *(size_t*)value = SOFT_ALLOC_GRANULE; break;
+    case HSA_REGION_INFO_RUNTIME_ALLOC_ALIGNMENT: *(size_t*)value = SOFT_ALLOC_GRANULE; break;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_memory_allocate(hsa_region_t region, size_t size, void** ptr) {
+    if (region.handle != SOFT_REGION_SYSTEM && region.handle != SOFT_REGION_LOCAL) {
+        return HSA_STATUS_ERROR_INVALID_REGION;
+    }
+    if (size == 0 || ptr == NULL) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    if (posix_memalign(ptr, SOFT_ALLOC_GRANULE, size) != 0) {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_memory_free(void* ptr) {
+    free(ptr);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_memory_copy(void* dst, const void* src, size_t size) {
+    memcpy(dst, src, size);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_memory_assign_agent(void* ptr, hsa_agent_t agent, int access) {
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_memory_register(void* ptr, size_t size) {
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_memory_deregister(void* ptr, size_t size) {
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Copies out of a GPU, to the host or to a peer, run on its outbound
+ * engine; copies from the host run on the destination's inbound engine.
+ */
+hsa_status_t HSA_API hsa_amd_memory_async_copy(void* dst, hsa_agent_t dst_agent, const void* src, hsa_agent_t src_agent,
+                                               size_t size, uint32_t num_dep_signals, const hsa_signal_t* dep_signals,
+                                               hsa_signal_t completion_signal) {
+    SoftAgent* to = soft_agent(dst_agent);
+    SoftAgent* from = soft_agent(src_agent);
+    if (to == NULL || from == NULL) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (dst == NULL || src == NULL || completion_signal.handle == 0 || (num_dep_signals > 0 && dep_signals == NULL)) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    DmaEngine* engine = from->device == HSA_DEVICE_TYPE_GPU ? from->dma_out : to->dma_in;
+    engine->copy(dst, src, size, num_dep_signals, dep_signals, completion_signal);
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Every region is host memory, so every agent can already access every
+ * buffer; only the arguments are checked.
+ */
+hsa_status_t HSA_API hsa_amd_agents_allow_access(uint32_t num_agents, const hsa_agent_t* agents, const uint32_t* flags,
+                                                 const void* ptr) {
+    if (num_agents == 0 || agents == NULL || ptr == NULL) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    for (uint32_t i = 0; i < num_agents; i++) {
+        if (soft_agent(agents[i]) == NULL) {
+            return HSA_STATUS_ERROR_INVALID_AGENT;
+        }
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * Signals.
+ */
+hsa_status_t HSA_API hsa_signal_create(hsa_signal_value_t initial_value, uint32_t num_consumers,
+                                       const hsa_agent_t* consumers, hsa_signal_t* signal) {
+    if (signal == NULL) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    SoftSignal* s = new SoftSignal;
+    s->value = initial_value;
+    s->waiters = 0;
+    signal->handle = (uint64_t)s;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_signal_destroy(hsa_signal_t signal) {
+    if (signal.handle == 0) {
+        return HSA_STATUS_ERROR_INVALID_SIGNAL;
+    }
+    delete soft_signal(signal);
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_signal_value_t HSA_API hsa_signal_load_acquire(hsa_signal_t signal) {
+    return soft_signal(signal)->value.load(std::memory_order_acquire);
+}
+
+hsa_signal_value_t HSA_API hsa_signal_load_relaxed(hsa_signal_t signal) {
+    return soft_signal(signal)->value.load(std::memory_order_relaxed);
+}
+
+void HSA_API hsa_signal_store_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
+    soft_signal(signal)->value.store(value);
+    signal_changed(soft_signal(signal));
+}
+
+void HSA_API hsa_signal_store_release(hsa_signal_t signal, hsa_signal_value_t value) {
+    soft_signal(signal)->value.store(value);
+    signal_changed(soft_signal(signal));
+}
+
+hsa_signal_value_t HSA_API hsa_signal_exchange_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
+    hsa_signal_value_t old = soft_signal(signal)->value.exchange(value);
+    signal_changed(soft_signal(signal));
+    return old;
+}
+
+hsa_signal_value_t HSA_API hsa_signal_cas_acq_rel(hsa_signal_t signal, hsa_signal_value_t expected, hsa_signal_value_t value) {
+    soft_signal(signal)->value.compare_exchange_strong(expected, value);
+    signal_changed(soft_signal(signal));
+    return expected;
+}
+
+void HSA_API hsa_signal_add_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
+    soft_signal(signal)->value.fetch_add(value);
+    signal_changed(soft_signal(signal));
+}
+
+void HSA_API hsa_signal_subtract_acq_rel(hsa_signal_t signal, hsa_signal_value_t value) {
+    soft_signal(signal)->value.fetch_sub(value);
+    signal_changed(soft_signal(signal));
+}
+
+void HSA_API hsa_signal_subtract_release(hsa_signal_t signal, hsa_signal_value_t value) {
+    hsa_signal_subtract_acq_rel(signal, value);
+}
+
+void HSA_API hsa_signal_subtract_relaxed(hsa_signal_t signal, hsa_signal_value_t value) {
+    hsa_signal_subtract_acq_rel(signal, value);
+}
+
+/*
+ * timeout_hint is in timestamp ticks, which are nanoseconds here.
+ * HSA_WAIT_STATE_ACTIVE spins; HSA_WAIT_STATE_BLOCKED sleeps until the
+ * signal changes.
+ */
+hsa_signal_value_t HSA_API hsa_signal_wait_acquire(hsa_signal_t signal, hsa_signal_condition_t condition,
+                                                   hsa_signal_value_t compare_value, uint64_t timeout_hint,
+                                                   hsa_wait_state_t wait_state_hint) {
+    SoftSignal* s = soft_signal(signal);
+    hsa_signal_value_t value = s->value.load(std::memory_order_acquire);
+    if (signal_satisfied(condition, value, compare_value)) {
+        return value;
+    }
+
+    bool forever = timeout_hint == UINT64_MAX;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+        std::chrono::nanoseconds(forever ? 0 : timeout_hint);
+    if (wait_state_hint == HSA_WAIT_STATE_ACTIVE) {
+        while (!signal_satisfied(condition, value = s->value.load(std::memory_order_acquire), compare_value)) {
+            if (!forever && std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+        }
+        return value;
+    }
+
+    std::unique_lock<std::mutex> guard(s->lock);
+    s->waiters++;
+    while (!signal_satisfied(condition, value = s->value.load(std::memory_order_acquire), compare_value)) {
+        if (forever) {
+            s->changed.wait(guard);
+        } else if (s->changed.wait_until(guard, deadline) == std::cv_status::timeout) {
+            value = s->value.load(std::memory_order_acquire);
+            break;
+        }
+    }
+    s->waiters--;
+    return value;
+}
+
+/*
+ * Returns the index of the first signal that satisfies its condition, or
+ * UINT32_MAX once timeout_hint has passed without one.
+ */
+uint32_t HSA_API hsa_amd_signal_wait_any(uint32_t signal_count, hsa_signal_t* signals, hsa_signal_condition_t* conds,
+                                         hsa_signal_value_t* values, uint64_t timeout_hint, hsa_wait_state_t wait_hint,
+                                         hsa_signal_value_t* satisfying_value) {
+    bool forever = timeout_hint == UINT64_MAX;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+        std::chrono::nanoseconds(forever ? 0 : timeout_hint);
+    std::unique_lock<std::mutex> guard(any_lock, std::defer_lock);
+    if (wait_hint != HSA_WAIT_STATE_ACTIVE) {
+        guard.lock();
+        any_waiters++;
+    }
+    uint32_t found = UINT32_MAX;
+    for (;;) {
+        for (uint32_t i = 0; i < signal_count && found == UINT32_MAX; i++) {
+            hsa_signal_value_t value = soft_signal(signals[i])->value.load(std::memory_order_acquire);
+            if (signal_satisfied(conds[i], value, values[i])) {
+                found = i;
+                if (satisfying_value != NULL) {
+                    *satisfying_value = value;
+                }
+            }
+        }
+        if (found != UINT32_MAX || (!forever && std::chrono::steady_clock::now() >= deadline)) {
+            break;
+        }
+        if (wait_hint == HSA_WAIT_STATE_ACTIVE) {
+            continue;
+        }
+        if (forever) {
+            any_changed.wait(guard);
+        } else {
+            any_changed.wait_until(guard, deadline);
+        }
+    }
+    if (wait_hint != HSA_WAIT_STATE_ACTIVE) {
+        any_waiters--;
+    }
+    return found;
+}
+
+hsa_signal_value_t HSA_API hsa_signal_wait_relaxed(hsa_signal_t signal, hsa_signal_condition_t condition,
+                                                   hsa_signal_value_t compare_value, uint64_t timeout_hint,
+                                                   hsa_wait_state_t wait_state_hint) {
+    return hsa_signal_wait_acquire(signal, condition, compare_value, timeout_hint, wait_state_hint);
+}
+
+/*
+ * Code objects and executables. A serialized code object is just the magic
+ * and the ISA; every executable resolves symbols against the registry.
+ */
+hsa_status_t HSA_API hsa_code_object_serialize(hsa_code_object_t code_object,
+                                               hsa_status_t (*alloc_callback)(size_t size, hsa_callback_data_t data, void** address),
+                                               hsa_callback_data_t callback_data, const char* options,
+                                               void** serialized_code_object, size_t* serialized_code_object_size) {
+    if (code_object.handle == 0) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+    }
+    size_t size = strlen(SOFT_CODE_OBJECT_MAGIC) + sizeof(hsa_isa_t);
+    hsa_status_t status = alloc_callback(size, callback_data, serialized_code_object);
+    if (status != HSA_STATUS_SUCCESS) {
+        return status;
+    }
+    memcpy(*serialized_code_object, SOFT_CODE_OBJECT_MAGIC, strlen(SOFT_CODE_OBJECT_MAGIC));
+    memcpy((char*)*serialized_code_object + strlen(SOFT_CODE_OBJECT_MAGIC), &((SoftCodeObject*)code_object.handle)->isa,
+           sizeof(hsa_isa_t));
+    *serialized_code_object_size = size;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_code_object_deserialize(void* serialized_code_object, size_t serialized_code_object_size,
+                                                 const char* options, hsa_code_object_t* code_object) {
+    size_t magic = strlen(SOFT_CODE_OBJECT_MAGIC);
+    if (serialized_code_object_size != magic + sizeof(hsa_isa_t) ||
+        memcmp(serialized_code_object, SOFT_CODE_OBJECT_MAGIC, magic) != 0) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+    }
+    SoftCodeObject* co = new SoftCodeObject;
+    memcpy(&co->isa, (char*)serialized_code_object + magic, sizeof(hsa_isa_t));
+    code_object->handle = (uint64_t)co;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_code_object_destroy(hsa_code_object_t code_object) {
+    if (code_object.handle == 0) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+    }
+    delete (SoftCodeObject*)code_object.handle;
+    return HSA_STATUS_SUCCESS;
+}
+
+struct SoftExecutable {
+    hsa_executable_state_t state;
+};
+
+hsa_status_t HSA_API hsa_executable_create(hsa_profile_t profile, hsa_executable_state_t executable_state,
+                                           const char* options, hsa_executable_t* executable) {
+    SoftExecutable* exe = new SoftExecutable;
+    exe->state = executable_state;
+    executable->handle = (uint64_t)exe;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_executable_destroy(hsa_executable_t executable) {
+    delete (SoftExecutable*)executable.handle;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_executable_load_code_object(hsa_executable_t executable, hsa_agent_t agent,
+                                                     hsa_code_object_t code_object, const char* options) {
+    if (soft_agent(agent) == NULL) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (code_object.handle == 0) {
+        return HSA_STATUS_ERROR_INVALID_CODE_OBJECT;
+    }
+    if (((SoftExecutable*)executable.handle)->state == HSA_EXECUTABLE_STATE_FROZEN) {
+        return HSA_STATUS_ERROR_FROZEN_EXECUTABLE;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_executable_freeze(hsa_executable_t executable, const char* options) {
+    ((SoftExecutable*)executable.handle)->state = HSA_EXECUTABLE_STATE_FROZEN;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_executable_get_symbol(hsa_executable_t executable, const char* module_name, const char* symbol_name,
+                                               hsa_agent_t agent, int32_t call_convention, hsa_executable_symbol_t* symbol) {
+    if (soft_agent(agent) == NULL) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    std::lock_guard<std::mutex> guard(registry_lock());
+    std::map<std::string, SoftKernel*>::iterator it = registry().find(symbol_name);
+    if (it == registry().end()) {
+        return HSA_STATUS_ERROR_INVALID_SYMBOL_NAME;
+    }
+    symbol->handle = (uint64_t)it->second;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_executable_symbol_get_info(hsa_executable_symbol_t executable_symbol,
+                                                    hsa_executable_symbol_info_t attribute, void* value) {
+    SoftKernel* kernel = (SoftKernel*)executable_symbol.handle;
+    switch (attribute) {
+    case HSA_EXECUTABLE_SYMBOL_INFO_NAME_LENGTH: *(uint32_t*)value = kernel->name.size(); break;
+    case HSA_EXECUTABLE_SYMBOL_INFO_NAME: memcpy(value, kernel->name.c_str(), kernel->name.size()); break;
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_OBJECT: *(uint64_t*)value = (uint64_t)kernel; break;
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_SIZE: *(uint32_t*)value = kernel->kernarg_segment_size; break;
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_KERNARG_SEGMENT_ALIGNMENT: *(uint32_t*)value = 16; break;
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_GROUP_SEGMENT_SIZE: *(uint32_t*)value = 0; break;
+    case HSA_EXECUTABLE_SYMBOL_INFO_KERNEL_PRIVATE_SEGMENT_SIZE: *(uint32_t*)value = 0; break;
+    default: return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+    return HSA_STATUS_SUCCESS;
+}
+
+/*
+ * The packet processor. Packets run strictly one after another, so every
+ * packet already behaves as if its barrier bit were set, and the host and
+ * the workers share memory, so the acquire and release fences reduce to
+ * thread fences.
+ */
+static void run_kernel_dispatch(hsa_kernel_dispatch_packet_t* packet) {
+    SoftKernel* kernel = (SoftKernel*)packet->kernel_object;
+    uint32_t dims = (packet->setup >> HSA_KERNEL_DISPATCH_PACKET_SETUP_DIMENSIONS) & 3;
+    soft_workgroup_t base;
+    base.grid_size[0] = packet->grid_size_x;
+    base.grid_size[1] = dims > 1 ? packet->grid_size_y : 1;
+    base.grid_size[2] = dims > 2 ? packet->grid_size_z : 1;
+    base.workgroup_size[0] = packet->workgroup_size_x ? packet->workgroup_size_x : 1;
+    base.workgroup_size[1] = dims > 1 && packet->workgroup_size_y ? packet->workgroup_size_y : 1;
+    base.workgroup_size[2] = dims > 2 && packet->workgroup_size_z ? packet->workgroup_size_z : 1;
+
+    uint64_t groups[3];
+    for (int d = 0; d < 3; d++) {
+        groups[d] = (base.grid_size[d] + base.workgroup_size[d] - 1) / base.workgroup_size[d];
+    }
+    const void* kernarg = packet->kernarg_address;
+    std::function<void(uint64_t)> run_group = [&](uint64_t g) {
+        soft_workgroup_t workgroup = base;
+        workgroup.group_id[0] = g % groups[0];
+        workgroup.group_id[1] = (g / groups[0]) % groups[1];
+        workgroup.group_id[2] = g / (groups[0] * groups[1]);
+        kernel->fn(kernarg, &workgroup);
+    };
+    workers->run(groups[0] * groups[1] * groups[2], (soft_schedule_t)schedule.load(), run_group);
+}
+
+/*
+ * Blocks until every dependency of a barrier-AND packet, or any one of a
+ * barrier-OR packet, has reached 0. Null dependencies are ignored.
+ */
+static void run_barrier(hsa_barrier_and_packet_t* packet, bool any) {
+    bool has_dependency = false;
+    for (;;) {
+        for (int i = 0; i < 5; i++) {
+            if (packet->dep_signal[i].handle == 0) {
+                continue;
+            }
+            has_dependency = true;
+            if (hsa_signal_load_acquire(packet->dep_signal[i]) == 0) {
+                if (any) {
+                    return;
+                }
+            } else if (!any) {
+                hsa_signal_wait_acquire(packet->dep_signal[i], HSA_SIGNAL_CONDITION_EQ, 0, UINT64_MAX, HSA_WAIT_STATE_BLOCKED);
+            }
+        }
+        if (!any || !has_dependency) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+static void process(SoftQueue* q) {
+    hsa_queue_t* queue = &q->queue;
+    for (;;) {
+        uint64_t read = q->read_index.load(std::memory_order_relaxed);
+        uint16_t* header = (uint16_t*)((char*)queue->base_address + (read & (queue->size - 1)) * 64);
+        uint16_t value = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+        uint8_t type = (value >> HSA_PACKET_HEADER_TYPE) & ((1 << HSA_PACKET_HEADER_WIDTH_TYPE) - 1);
+        if (type == HSA_PACKET_TYPE_INVALID) {
+            /*
+             * Sleep on the doorbell. The producer publishes the header
+             * before it rings, so checking the header under the doorbell
+             * lock cannot miss a packet.
+             */
+            SoftSignal* doorbell = q->doorbell;
+            std::unique_lock<std::mutex> guard(doorbell->lock);
+            doorbell->waiters++;
+            while (!q->stopping && ((__atomic_load_n(header, __ATOMIC_ACQUIRE) >> HSA_PACKET_HEADER_TYPE) & 0xff) ==
+                   HSA_PACKET_TYPE_INVALID) {
+                doorbell->changed.wait(guard);
+            }
+            doorbell->waiters--;
+            if (q->stopping) {
+                return;
+            }
+            continue;
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        hsa_signal_t completion_signal = {0};
+        switch (type) {
+        case HSA_PACKET_TYPE_KERNEL_DISPATCH:
+            run_kernel_dispatch((hsa_kernel_dispatch_packet_t*)header);
+            completion_signal = ((hsa_kernel_dispatch_packet_t*)header)->completion_signal;
+            break;
+        case HSA_PACKET_TYPE_BARRIER_AND:
+        case HSA_PACKET_TYPE_BARRIER_OR:
+            run_barrier((hsa_barrier_and_packet_t*)header, type == HSA_PACKET_TYPE_BARRIER_OR);
+            completion_signal = ((hsa_barrier_and_packet_t*)header)->completion_signal;
+            break;
+        default:
+            fprintf(stderr, "soft_hsa: skipping packet of unsupported type %u at index %llu\n", type,
+                    (unsigned long long)read);
+            break;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        if (completion_signal.handle != 0) {
+            hsa_signal_subtract_release(completion_signal, 1);
+        }
+
+        __atomic_store_n(header, (uint16_t)(HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE), __ATOMIC_RELEASE);
+        q->read_index.store(read + 1, std::memory_order_release);
+    }
+}
+
+hsa_status_t HSA_API hsa_queue_create(hsa_agent_t agent, uint32_t size, hsa_queue_type_t type,
+                                      void (*callback)(hsa_status_t status, hsa_queue_t* source, void* data), void* data,
+                                      uint32_t private_segment_size, uint32_t group_segment_size, hsa_queue_t** queue) {
+    SoftAgent* a = soft_agent(agent);
+    if (a == NULL) {
+        return HSA_STATUS_ERROR_INVALID_AGENT;
+    }
+    if (a->device != HSA_DEVICE_TYPE_GPU) {
+        return HSA_STATUS_ERROR_INVALID_QUEUE_CREATION;
+    }
+    if (size < SOFT_QUEUE_MIN_SIZE || size > SOFT_QUEUE_MAX_SIZE || (size & (size - 1)) != 0) {
+        return HSA_STATUS_ERROR_INVALID_ARGUMENT;
+    }
+
+    void* ring = NULL;
+    if (posix_memalign(&ring, 64, (size_t)size * 64) != 0) {
+        return HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+    }
+    memset(ring, 0, (size_t)size * 64);
+    for (uint32_t i = 0; i < size; i++) {
+        *(uint16_t*)((char*)ring + (size_t)i * 64) = HSA_PACKET_TYPE_INVALID << HSA_PACKET_HEADER_TYPE;
+    }
+
+    SoftQueue* q = new SoftQueue;
+    memset(&q->queue, 0, sizeof(q->queue));
+    q->queue.type = type;
+    q->queue.features = HSA_QUEUE_FEATURE_KERNEL_DISPATCH;
+    q->queue.base_address = ring;
+    q->queue.size = size;
+    q->queue.id = __atomic_fetch_add(&next_queue_id, 1, __ATOMIC_RELAXED);
+    q->write_index = 0;
+    q->read_index = 0;
+    q->stopping = false;
+    hsa_signal_create(0, 0, NULL, &q->queue.doorbell_signal);
+    q->doorbell = soft_signal(q->queue.doorbell_signal);
+    q->processor = std::thread(process, q);
+    *queue = &q->queue;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_queue_destroy(hsa_queue_t* queue) {
+    if (queue == NULL) {
+        return HSA_STATUS_ERROR_INVALID_QUEUE;
+    }
+    SoftQueue* q = soft_queue(queue);
+    {
+        std::lock_guard<std::mutex> guard(q->doorbell->lock);
+        q->stopping = true;
+        q->doorbell->changed.notify_all();
+    }
+    q->processor.join();
+    hsa_signal_destroy(queue->doorbell_signal);
+    free(queue->base_address);
+    delete q;
+    return HSA_STATUS_SUCCESS;
+}
+
+hsa_status_t HSA_API hsa_queue_inactivate(hsa_queue_t* queue) {
+    return HSA_STATUS_SUCCESS;
+}
+
+uint64_t HSA_API hsa_queue_load_read_index_acquire(const hsa_queue_t* queue) {
+    return soft_queue(queue)->read_index.load(std::memory_order_acquire);
+}
+
+uint64_t HSA_API hsa_queue_load_read_index_relaxed(const hsa_queue_t* queue) {
+    return soft_queue(queue)->read_index.load(std::memory_order_relaxed);
+}
+
+uint64_t HSA_API hsa_queue_load_write_index_acquire(const hsa_queue_t* queue) {
+    return soft_queue(queue)->write_index.load(std::memory_order_acquire);
+}
+
+uint64_t HSA_API hsa_queue_load_write_index_relaxed(const hsa_queue_t* queue) {
+    return soft_queue(queue)->write_index.load(std::memory_order_relaxed);
+}
+
+void HSA_API hsa_queue_store_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    soft_queue(queue)->write_index.store(value, std::memory_order_relaxed);
+}
+
+void HSA_API hsa_queue_store_write_index_release(const hsa_queue_t* queue, uint64_t value) {
+    soft_queue(queue)->write_index.store(value, std::memory_order_release);
+}
+
+uint64_t HSA_API hsa_queue_cas_write_index_acq_rel(const hsa_queue_t* queue, uint64_t expected, uint64_t value) {
+    soft_queue(queue)->write_index.compare_exchange_strong(expected, value, std::memory_order_acq_rel);
+    return expected;
+}
+
+uint64_t HSA_API hsa_queue_cas_write_index_relaxed(const hsa_queue_t* queue, uint64_t expected, uint64_t value) {
+    soft_queue(queue)->write_index.compare_exchange_strong(expected, value, std::memory_order_relaxed);
+    return expected;
+}
+
+uint64_t HSA_API hsa_queue_add_write_index_acq_rel(const hsa_queue_t* queue, uint64_t value) {
+    return soft_queue(queue)->write_index.fetch_add(value, std::memory_order_acq_rel);
+}
+
+uint64_t HSA_API hsa_queue_add_write_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    return soft_queue(queue)->write_index.fetch_add(value, std::memory_order_relaxed);
+}
+
+void HSA_API hsa_queue_store_read_index_relaxed(const hsa_queue_t* queue, uint64_t value) {
+    soft_queue(queue)->read_index.store(value, std::memory_order_relaxed);
+}
+
+void HSA_API hsa_queue_store_read_index_release(const hsa_queue_t* queue, uint64_t value) {
+    soft_queue(queue)->read_index.store(value, std::memory_order_release);
+}
@@ -0,0 +1,93 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+#ifndef SOFT_HSA_H
+#define SOFT_HSA_H
+
+#include <stdint.h>
+
+/*
+ * A software stand-in for the HSA runtime. soft_hsa.cpp implements the
+ * subset of the hsa_* API the programs in this directory use: agents,
+ * regions, signals, code objects, executables and AQL queues with a
+ * doorbell. Linking it instead of libhsa-runtime64 runs them unmodified on
+ * any machine. Each queue has a packet-processor thread that decodes
+ * kernel dispatch and barrier packets; kernel dispatches run on a pool of
+ * worker threads, one workgroup per call of a registered C++ kernel
+ * function, and decrement their completion signal when all workgroups are
+ * done. hsa_amd_memory_async_copy is there as well, on one copy thread per
+ * agent standing in for its DMA engine.
+ *
+ * Finalization accepts any BRIG module and every executable exposes every
+ * registered kernel, so the kernel behind a symbol is whatever was
+ * registered under that name. "&__vector_copy_kernel" is built in.
+ *
+ * SOFT_HSA_AGENTS sets the number of GPU agents (default 2),
+ * SOFT_HSA_THREADS the number of workers (default: one per core) and
+ * SOFT_HSA_SCHEDULE how workgroups are spread over them, "static" or
+ * "stealing" (the default).
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The workgroup a kernel function is called for. Work-item x of the
+ * workgroup has the absolute id group_id[0] * workgroup_size[0] + x, and
+ * only ids below grid_size exist: the last workgroup may be partial.
+ */
+typedef struct soft_workgroup_s {
+    uint32_t group_id[3];
+    uint16_t workgroup_size[3];
+    uint32_t grid_size[3];
+} soft_workgroup_t;
+
+typedef void (*soft_kernel_t)(const void* kernarg, const soft_workgroup_t* workgroup);
+
+/*
+ * How the workgroups of a dispatch are spread over the workers.
+ * SOFT_SCHEDULE_STATIC gives every worker one equal contiguous range;
+ * SOFT_SCHEDULE_STEALING starts from the same ranges but lets idle workers
+ * steal from busy ones, so workgroups of uneven cost still keep every
+ * worker busy until the end.
+ */
+typedef enum {
+    SOFT_SCHEDULE_STATIC,
+    SOFT_SCHEDULE_STEALING
+} soft_schedule_t;
+
+/*
+ * Selects the schedule for dispatches that start after the call.
+ */
+void soft_hsa_set_schedule(soft_schedule_t schedule);
+
+/*
+ * Makes fn available as the kernel symbol name in every executable.
+ * Must be called before the symbol is looked up.
+ */
+void soft_hsa_register_kernel(const char* name, soft_kernel_t fn, uint32_t kernarg_segment_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
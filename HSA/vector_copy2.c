@@ -221,7 +221,8 @@ int main(int argc, char **argv) {
     //check(Query the agents isa, err);
 
     /*
-     * Finalize the program and extract the code object.
+     * Finalize the program and extract the code object. Agents with the
+     * same ISA share one code object instead of finalizing twice.
      */
     hsa_ext_control_directives_t control_directives1;
     hsa_ext_control_directives_t control_directives2;
@@ -230,7 +231,11 @@ int main(int argc, char **argv) {
     hsa_code_object_t code_object1;
     hsa_code_object_t code_object2;
     err = table_1_00.hsa_ext_program_finalize(program, isa1, 0, control_directives1, "", HSA_CODE_OBJECT_TYPE_PROGRAM, &code_object1);
-    err = table_1_00.hsa_ext_program_finalize(program, isa2, 0, control_directives2, "", HSA_CODE_OBJECT_TYPE_PROGRAM, &code_object2);
+    if (isa2.handle == isa1.handle) {
+        code_object2 = code_object1;
+    } else {
+        err = table_1_00.hsa_ext_program_finalize(program, isa2, 0, control_directives2, "", HSA_CODE_OBJECT_TYPE_PROGRAM, &code_object2);
+    }
     //check(Finalizing the program, err);
 
     /*
@@ -496,7 +501,9 @@ int main(int argc, char **argv) {
     //check(Destroying the executable, err);
 
     err=hsa_code_object_destroy(code_object1);
-    err=hsa_code_object_destroy(code_object2);
+    if (code_object2.handle != code_object1.handle) {
+        err=hsa_code_object_destroy(code_object2);
+    }
     //check(Destroying the code object, err);
 
     err=hsa_queue_destroy(queue2);
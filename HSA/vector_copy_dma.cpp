@@ -0,0 +1,213 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "hsa_dispatch.h"
+
+#define COPY_WORKGROUP 256
+
+/*
+ * Staged vector copy across GPU agents with asynchronous DMA copies. The
+ * host array of --elems 32-bit elements is cut into --chunks chunks dealt
+ * round-robin to the agents; each chunk is uploaded into device-local
+ * memory of its agent, copied there by the vector_copy kernel and
+ * downloaded into the host output array. With --peer the result is first
+ * copied to the next agent's memory and downloaded from there, which adds
+ * a peer-to-peer copy per chunk.
+ *
+ * Every step is a node of a TaskGraph submitted up front, so while one
+ * chunk runs its kernel the DMA engines already upload the next and
+ * download the previous one. The same transfer is timed once with a
+ * single chunk per agent, where upload, kernel and download of an agent
+ * cannot overlap, and once with the requested chunks. The host output is
+ * validated after every run. Every run rebuilds the same graph, whose
+ * copy signals are created once before the first one is timed.
+ *
+ * Usage: vector_copy_dma [--elems N] [--chunks C] [--peer] [--repeat R] <vector_copy.brig>
+ */
+
+struct __attribute__ ((aligned(16))) args_t {
+    void* in;
+    void* out;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Runs the staged copy of elems elements from in to out in chunks chunks
+ * on graph and returns the time it took, or a negative value if the
+ * output is wrong.
+ */
+static double run(TaskGraph& graph, std::vector<Device*>& devices, std::vector<MemoryPool*>& pools, hsa_agent_t host,
+                  uint32_t* in, uint32_t* out, size_t elems, size_t chunks, bool peer) {
+    size_t n = devices.size();
+    memset(out, 0, elems * sizeof(uint32_t));
+
+    graph.clear();
+    std::vector<void*> buffers;
+    std::vector<MemoryPool*> owners;
+    size_t base = elems / chunks, rem = elems % chunks;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t c = 0; c < chunks; c++) {
+        size_t first = c * base + (c < rem ? c : rem);
+        size_t length = base + (c < rem ? 1 : 0);
+        size_t bytes = length * sizeof(uint32_t);
+        if (length == 0) {
+            continue;
+        }
+        size_t a = c % n;
+        Device* device = devices[a];
+        hsa_agent_t agent = device->agent->handle;
+
+        args_t args;
+        args.in = pools[a]->allocate(bytes);
+        args.out = pools[a]->allocate(bytes);
+        buffers.push_back(args.in);
+        buffers.push_back(args.out);
+        owners.push_back(pools[a]);
+        owners.push_back(pools[a]);
+
+        TaskGraph::Node upload = graph.add_copy(args.in, agent, in + first, host, bytes);
+        TaskGraph::Node kernel = graph.add(*device->queue, *device->kernel, Grid((uint32_t)length, COPY_WORKGROUP), args,
+                                           std::vector<TaskGraph::Node>(1, upload));
+        const void* result = args.out;
+        hsa_agent_t result_agent = agent;
+        TaskGraph::Node last = kernel;
+        if (peer && n > 1) {
+            size_t b = (a + 1) % n;
+            void* copy = pools[b]->allocate(bytes);
+            buffers.push_back(copy);
+            owners.push_back(pools[b]);
+            pools[b]->allow_access(copy, *device->agent);
+            last = graph.add_copy(copy, devices[b]->agent->handle, args.out, agent, bytes,
+                                  std::vector<TaskGraph::Node>(1, kernel));
+            result = copy;
+            result_agent = devices[b]->agent->handle;
+        }
+        graph.add_copy(out + first, host, result, result_agent, bytes, std::vector<TaskGraph::Node>(1, last));
+    }
+    graph.submit();
+    graph.wait();
+    double sec = seconds_since(start);
+
+    for (size_t i = 0; i < buffers.size(); i++) {
+        owners[i]->release(buffers[i]);
+    }
+    for (size_t j = 0; j < elems; j++) {
+        if (out[j] != in[j]) {
+            printf("VALIDATION FAILED!\nBad index: %zu\n", j);
+            return -1;
+        }
+    }
+    return sec;
+}
+
+int main(int argc, char **argv) {
+    const char* brig_file = NULL;
+    size_t elems = 16*1024*1024;
+    size_t chunks = 16;
+    size_t repeat = 3;
+    bool peer = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--elems") == 0 && i + 1 < argc) {
+            elems = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--chunks") == 0 && i + 1 < argc) {
+            chunks = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--peer") == 0) {
+            peer = true;
+        } else {
+            brig_file = argv[i];
+        }
+    }
+    if (brig_file == NULL || elems == 0 || elems > UINT32_MAX || chunks == 0 || repeat == 0) {
+        printf("Usage: %s [--elems N] [--chunks C] [--peer] [--repeat R] <vector_copy.brig>\n", argv[0]);
+        return 1;
+    }
+
+    Runtime runtime;
+    std::vector<Agent> agents = Agent::gpus();
+    if (agents.empty()) {
+        printf("No GPU agent found.\n");
+        return 1;
+    }
+    hsa_agent_t host = host_agent();
+    Program program(runtime, brig_file);
+    CodeObjectCache cache;
+    std::vector<Device*> devices = bring_up(cache, program, agents, "&__vector_copy_kernel");
+    std::vector<MemoryPool*> pools(devices.size());
+    for (size_t i = 0; i < devices.size(); i++) {
+        pools[i] = new MemoryPool(*devices[i]->agent, MEMORY_DEVICE_LOCAL);
+    }
+    if (chunks < devices.size()) {
+        chunks = devices.size();
+    }
+
+    /*
+     * Host arrays come from the fine-grained system region, which the DMA
+     * engines can read and write directly.
+     */
+    size_t bytes = elems * sizeof(uint32_t);
+    uint32_t* in = NULL;
+    uint32_t* out = NULL;
+    hsa_check(hsa_memory_allocate(agents[0].system_region, bytes, (void**)&in), "Allocating the host input array");
+    hsa_check(hsa_memory_allocate(agents[0].system_region, bytes, (void**)&out), "Allocating the host output array");
+    for (size_t j = 0; j < elems; j++) {
+        in[j] = (uint32_t)j;
+    }
+    printf("%zu bytes on %zu agents in %s buffers%s\n", bytes, devices.size(), memory_mode_name(pools[0]->mode),
+           peer && devices.size() > 1 ? ", results through the next agent" : "");
+
+    /* An upload and a download per chunk, and a peer copy with --peer. */
+    TaskGraph graph((uint32_t)(chunks * (peer ? 3 : 2)));
+    int valid = 1;
+    size_t counts[2] = {devices.size(), chunks};
+    for (int k = 0; k < 2; k++) {
+        double total = 0;
+        for (size_t r = 0; r < repeat && valid; r++) {
+            double sec = run(graph, devices, pools, host, in, out, elems, counts[k], peer);
+            valid = sec >= 0;
+            total += sec;
+        }
+        if (valid) {
+            printf("%4zu chunks: %.3f ms, %.2f GB/s\n", counts[k], total / repeat * 1e3, bytes / (total / repeat) / 1e9);
+        }
+    }
+    if (valid) {
+        printf("Passed validation.\n");
+    }
+
+    hsa_memory_free(in);
+    hsa_memory_free(out);
+    for (size_t i = 0; i < devices.size(); i++) {
+        delete pools[i];
+        delete devices[i];
+    }
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,319 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "hsa_dispatch.h"
+
+#define COPY_BYTES (1024*1024*4)
+#define COPY_WORKGROUP 256
+
+/*
+ * vector_copy2 generalized to every GPU agent through the dispatch library.
+ * Code objects come from a CodeObjectCache, so agents that share an ISA are
+ * finalized once; with a cache directory later runs skip finalization.
+ *
+ * By default each agent gets its own buffers and copies the full array, as
+ * in vector_copy2. With --partition one buffer of --elems 32-bit elements
+ * is split into contiguous per-agent ranges instead, every agent copies
+ * only its range, and the copy is timed across all agents together; with
+ * --agents K the first K agents are used, so scaling can be measured on
+ * one data set. In both modes all dispatches are issued before any is
+ * waited on and every output is validated. --memory local or zero-copy
+ * moves the per-agent buffers of the default mode from registered host
+ * arrays into a MemoryPool of that mode.
+ *
+ * Per-agent bring-up runs on one thread per agent (--serial runs it agent
+ * after agent for comparison) and the time of every start-up phase is
+ * printed, up to the first dispatch. The time to first dispatch leaves out
+ * the buffer setup of the copy, which is printed separately.
+ */
+
+struct __attribute__ ((aligned(16))) args_t {
+    void* in;
+    void* out;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Every agent copies its own COPY_BYTES array. Dispatches complete through
+ * a Waiter, so each agent's output is validated as soon as it is ready
+ * while the other agents are still copying. Returns 1 if all outputs are
+ * valid; first_dispatch is set once the first packet is submitted, and
+ * setup_sec to the time spent allocating, filling and registering or
+ * uploading the buffers before it.
+ *
+ * Without memory the kernels work on the registered host arrays, as in
+ * vector_copy2. With it each agent gets its buffers from a MemoryPool of
+ * that mode, the input is uploaded before the dispatch and the output
+ * downloaded before validation.
+ */
+static int copy_replicated(std::vector<Device*>& devices, const MemoryMode* memory,
+                           std::chrono::steady_clock::time_point& first_dispatch, double& setup_sec) {
+    std::chrono::steady_clock::time_point setup = std::chrono::steady_clock::now();
+    size_t n = devices.size();
+    std::vector<char*> in(n), out(n);
+    std::vector<void*> device_in(n), device_out(n);
+    std::vector<MemoryPool*> pools(n);
+    std::vector<std::future<void> > completions(n);
+
+    for (size_t i = 0; i < n; i++) {
+        in[i] = (char*)malloc(COPY_BYTES);
+        memset(in[i], 1, COPY_BYTES);
+        out[i] = (char*)malloc(COPY_BYTES);
+        memset(out[i], 0, COPY_BYTES);
+        if (memory == NULL) {
+            hsa_check(hsa_memory_register(in[i], COPY_BYTES), "Registering argument memory for input parameter");
+            hsa_check(hsa_memory_register(out[i], COPY_BYTES), "Registering argument memory for output parameter");
+            device_in[i] = in[i];
+            device_out[i] = out[i];
+        } else {
+            pools[i] = new MemoryPool(*devices[i]->agent, *memory);
+            device_in[i] = pools[i]->allocate(COPY_BYTES);
+            device_out[i] = pools[i]->allocate(COPY_BYTES);
+            pools[i]->upload(device_in[i], in[i], COPY_BYTES);
+            pools[i]->upload(device_out[i], out[i], COPY_BYTES);
+        }
+    }
+    setup_sec = seconds_since(setup);
+    if (memory != NULL) {
+        printf("Buffers: %s\n", memory_mode_name(pools[0]->mode));
+    }
+
+    Waiter waiter;
+    for (size_t i = 0; i < n; i++) {
+        args_t args;
+        args.in = device_in[i];
+        args.out = device_out[i];
+        completions[i] = dispatch_async(waiter, *devices[i]->queue, *devices[i]->kernel, Grid(COPY_BYTES/4, COPY_WORKGROUP), args);
+        if (i == 0) {
+            first_dispatch = std::chrono::steady_clock::now();
+        }
+    }
+
+    /*
+     * Validate the data in the output buffers.
+     */
+    int valid = 1;
+    for (size_t i = 0; i < n; i++) {
+        completions[i].wait();
+        if (memory != NULL) {
+            pools[i]->download(out[i], device_out[i], COPY_BYTES);
+        }
+        for (int j = 0; j < COPY_BYTES && valid; j++) {
+            if (out[i][j] != in[i][j]) {
+                printf("VALIDATION FAILED!\nBad index: %d on agent%zu\n", j, i);
+                valid = 0;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (memory == NULL) {
+            hsa_memory_deregister(in[i], COPY_BYTES);
+            hsa_memory_deregister(out[i], COPY_BYTES);
+        } else {
+            delete pools[i];
+        }
+        free(in[i]);
+        free(out[i]);
+    }
+    return valid;
+}
+
+/*
+ * One buffer of elems elements split into contiguous ranges, one per
+ * agent; the first elems % n agents take one extra element. The kernel
+ * indexes from its own work-item id, so each range is addressed by
+ * offsetting the kernarg pointers rather than the grid. Only the
+ * dispatches and their completion are timed, after the buffers are filled
+ * and registered. Returns 1 if the whole output is valid; first_dispatch is
+ * set once the first packet is submitted, whichever agent it goes to, and
+ * setup_sec to the time spent filling and registering the buffers.
+ */
+static int copy_partitioned(std::vector<Device*>& devices, size_t elems, std::chrono::steady_clock::time_point& first_dispatch,
+                            double& setup_sec) {
+    std::chrono::steady_clock::time_point setup = std::chrono::steady_clock::now();
+    size_t n = devices.size();
+    size_t bytes = elems * sizeof(uint32_t);
+    uint32_t* in = (uint32_t*)malloc(bytes);
+    uint32_t* out = (uint32_t*)malloc(bytes);
+    for (size_t j = 0; j < elems; j++) {
+        in[j] = (uint32_t)j;
+    }
+    memset(out, 0, bytes);
+    hsa_check(hsa_memory_register(in, bytes), "Registering argument memory for input parameter");
+    hsa_check(hsa_memory_register(out, bytes), "Registering argument memory for output parameter");
+    setup_sec = seconds_since(setup);
+
+    std::vector<Dispatch> dispatches;
+    std::vector<size_t> owners;
+    size_t base = elems / n, rem = elems % n;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i++) {
+        size_t first = i * base + (i < rem ? i : rem);
+        size_t length = base + (i < rem ? 1 : 0);
+        if (length == 0) {
+            continue;
+        }
+        args_t args;
+        args.in = in + first;
+        args.out = out + first;
+        dispatches.push_back(dispatch(*devices[i]->queue, *devices[i]->kernel, Grid((uint32_t)length, COPY_WORKGROUP), args));
+        owners.push_back(i);
+        if (dispatches.size() == 1) {
+            first_dispatch = std::chrono::steady_clock::now();
+        }
+    }
+    for (size_t i = 0; i < dispatches.size(); i++) {
+        wait(dispatches[i]);
+    }
+    double sec = seconds_since(start);
+
+    for (size_t k = 0; k < owners.size(); k++) {
+        size_t i = owners[k];
+        size_t first = i * base + (i < rem ? i : rem);
+        printf("  agent%zu: elements [%zu, %zu)\n", i, first, first + base + (i < rem ? 1 : 0));
+    }
+    printf("Copied %zu bytes on %zu agents in %.6f s, %.2f GB/s\n", bytes, dispatches.size(), sec, bytes / sec / 1e9);
+
+    int valid = 1;
+    for (size_t j = 0; j < elems; j++) {
+        if (out[j] != in[j]) {
+            size_t agent = n - 1;
+            for (size_t i = 1; i < n; i++) {
+                if (j < i * base + (i < rem ? i : rem)) {
+                    agent = i - 1;
+                    break;
+                }
+            }
+            printf("VALIDATION FAILED!\nBad index: %zu on agent%zu\n", j, agent);
+            valid = 0;
+            break;
+        }
+    }
+
+    hsa_memory_deregister(in, bytes);
+    hsa_memory_deregister(out, bytes);
+    free(in);
+    free(out);
+    return valid;
+}
+
+int main(int argc, char **argv) {
+    const char* brig_file = NULL;
+    const char* cache_dir = NULL;
+    bool parallel = true;
+    bool partition = false;
+    size_t elems = 64*1024*1024;
+    size_t max_agents = 0;
+    MemoryMode memory_mode = MEMORY_ZERO_COPY;
+    const MemoryMode* memory = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--serial") == 0) {
+            parallel = false;
+        } else if (strcmp(argv[i], "--partition") == 0) {
+            partition = true;
+        } else if (strcmp(argv[i], "--elems") == 0 && i + 1 < argc) {
+            elems = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            memory_mode = strcmp(argv[++i], "local") == 0 ? MEMORY_DEVICE_LOCAL : MEMORY_ZERO_COPY;
+            memory = &memory_mode;
+        } else if (strcmp(argv[i], "--agents") == 0 && i + 1 < argc) {
+            max_agents = strtoul(argv[++i], NULL, 0);
+        } else if (brig_file == NULL) {
+            brig_file = argv[i];
+        } else {
+            cache_dir = argv[i];
+        }
+    }
+    if (brig_file == NULL || elems == 0 || elems > UINT32_MAX) {
+        printf("Usage: %s [--serial] [--partition] [--elems N] [--agents K] [--memory local|zero-copy] <vector_copy.brig> [code object cache dir]\n",
+               argv[0]);
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point launch = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point start = launch;
+    Runtime runtime;
+    double runtime_sec = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    std::vector<Agent> agents = Agent::gpus();
+    if (agents.empty()) {
+        printf("No GPU agent found.\n");
+        return 1;
+    }
+    if (max_agents > 0 && max_agents < agents.size()) {
+        agents.erase(agents.begin() + max_agents, agents.end());
+    }
+    double agents_sec = seconds_since(start);
+    for (size_t i = 0; i < agents.size(); i++) {
+        printf("The agent%zu name is %s.\n", i, agents[i].name);
+    }
+
+    start = std::chrono::steady_clock::now();
+    Program program(runtime, brig_file);
+    double program_sec = seconds_since(start);
+
+    CodeObjectCache cache(cache_dir);
+    start = std::chrono::steady_clock::now();
+    std::vector<Device*> devices = bring_up(cache, program, agents, "&__vector_copy_kernel", parallel);
+    double bring_up_sec = seconds_since(start);
+
+    printf("Start-up: runtime %.3f s, agents %.3f s, program %.3f s, %s bring-up %.3f s\n", runtime_sec, agents_sec,
+           program_sec, parallel ? "parallel" : "serial", bring_up_sec);
+    for (size_t i = 0; i < devices.size(); i++) {
+        BringUpTimes& t = devices[i]->times;
+        printf("  agent%zu: queue %.3f s, finalize %.3f s, load %.3f s, symbol %.3f s\n", i, t.queue, t.finalize,
+               t.load, t.symbol);
+    }
+    printf("Code objects: %llu finalized, %llu loaded from disk, %llu shared\n", (unsigned long long)cache.misses,
+           (unsigned long long)cache.disk_hits, (unsigned long long)cache.hits);
+
+    /*
+     * Buffer setup grows with the agents and --elems rather than with
+     * bring-up, so it is reported as a phase of its own and left out of
+     * the time to first dispatch.
+     */
+    std::chrono::steady_clock::time_point first_dispatch = launch;
+    double setup_sec = 0;
+    int valid = partition ? copy_partitioned(devices, elems, first_dispatch, setup_sec)
+                          : copy_replicated(devices, memory, first_dispatch, setup_sec);
+    printf("Buffer setup: %.3f s\n", setup_sec);
+    printf("Time to first dispatch: %.3f s, excluding buffer setup\n",
+           std::chrono::duration<double>(first_dispatch - launch).count() - setup_sec);
+    if (valid) {
+        printf("Passed validation.\n");
+    }
+
+    for (size_t i = 0; i < devices.size(); i++) {
+        delete devices[i];
+    }
+    return valid ? 0 : 1;
+}
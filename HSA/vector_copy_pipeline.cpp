@@ -0,0 +1,159 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "hsa_dispatch.h"
+
+#define COPY_ELEMS (1024*1024)
+#define COPY_BYTES (COPY_ELEMS*4)
+#define COPY_WORKGROUP 256
+
+/*
+ * A copy pipeline across GPU agents: stage s runs on agent s % agents and
+ * copies buffer s into buffer s + 1, so every stage consumes the previous
+ * stage's output, usually on another GPU. The pipeline is run twice per
+ * repetition: once joined by the host, which waits for each stage before
+ * dispatching the next, and once as a TaskGraph, which enqueues every
+ * stage up front with barrier-AND packets between them. The difference is
+ * the host round trip per stage. The last buffer is validated after every
+ * run.
+ *
+ * Usage: vector_copy_pipeline [--stages N] [--repeat R] <vector_copy.brig>
+ */
+
+struct __attribute__ ((aligned(16))) args_t {
+    void* in;
+    void* out;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void prepare(std::vector<char*>& buffers, int pattern) {
+    memset(buffers[0], pattern, COPY_BYTES);
+    memset(buffers.back(), 0, COPY_BYTES);
+}
+
+static int validate(std::vector<char*>& buffers) {
+    if (memcmp(buffers[0], buffers.back(), COPY_BYTES) != 0) {
+        printf("VALIDATION FAILED!\n");
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    const char* brig_file = NULL;
+    size_t stages = 8;
+    size_t repeat = 10;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stages") == 0 && i + 1 < argc) {
+            stages = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = strtoul(argv[++i], NULL, 0);
+        } else {
+            brig_file = argv[i];
+        }
+    }
+    if (brig_file == NULL || stages == 0 || repeat == 0) {
+        printf("Usage: %s [--stages N] [--repeat R] <vector_copy.brig>\n", argv[0]);
+        return 1;
+    }
+
+    Runtime runtime;
+    std::vector<Agent> agents = Agent::gpus();
+    if (agents.empty()) {
+        printf("No GPU agent found.\n");
+        return 1;
+    }
+    Program program(runtime, brig_file);
+    CodeObjectCache cache;
+    std::vector<Device*> devices = bring_up(cache, program, agents, "&__vector_copy_kernel");
+    printf("%zu stages on %zu agents, %d bytes per stage\n", stages, devices.size(), COPY_BYTES);
+
+    std::vector<char*> buffers(stages + 1);
+    for (size_t i = 0; i <= stages; i++) {
+        buffers[i] = (char*)malloc(COPY_BYTES);
+        hsa_check(hsa_memory_register(buffers[i], COPY_BYTES), "Registering argument memory for pipeline buffer");
+    }
+    std::vector<args_t> args(stages);
+    for (size_t s = 0; s < stages; s++) {
+        args[s].in = buffers[s];
+        args[s].out = buffers[s + 1];
+    }
+    Grid grid(COPY_ELEMS, COPY_WORKGROUP);
+
+    int valid = 1;
+    double joined_sec = 0;
+    double graph_sec = 0;
+    uint64_t barriers = 0;
+    for (size_t r = 0; r < repeat; r++) {
+        prepare(buffers, (int)(2 * r + 1));
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t s = 0; s < stages; s++) {
+            Device* device = devices[s % devices.size()];
+            Dispatch d = dispatch(*device->queue, *device->kernel, grid, args[s]);
+            wait(d);
+        }
+        joined_sec += seconds_since(start);
+        valid &= validate(buffers);
+
+        prepare(buffers, (int)(2 * r + 2));
+        start = std::chrono::steady_clock::now();
+        TaskGraph graph;
+        TaskGraph::Node previous = 0;
+        for (size_t s = 0; s < stages; s++) {
+            Device* device = devices[s % devices.size()];
+            std::vector<TaskGraph::Node> deps;
+            if (s > 0) {
+                deps.push_back(previous);
+            }
+            previous = graph.add(*device->queue, *device->kernel, grid, args[s], deps);
+        }
+        graph.submit();
+        graph.wait();
+        graph_sec += seconds_since(start);
+        barriers = graph.barriers;
+        valid &= validate(buffers);
+    }
+
+    printf("host-joined: %.3f ms per pipeline\n", joined_sec / repeat * 1e3);
+    printf("task graph:  %.3f ms per pipeline, %llu barrier packets\n", graph_sec / repeat * 1e3,
+           (unsigned long long)barriers);
+    if (valid) {
+        printf("Passed validation.\n");
+    }
+
+    for (size_t i = 0; i <= stages; i++) {
+        hsa_memory_deregister(buffers[i], COPY_BYTES);
+        free(buffers[i]);
+    }
+    for (size_t i = 0; i < devices.size(); i++) {
+        delete devices[i];
+    }
+    return valid ? 0 : 1;
+}
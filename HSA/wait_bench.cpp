@@ -0,0 +1,216 @@
+/* Copyright 2014 HSA Foundation Inc.  All Rights Reserved.
+ *
+ * HSAF is granting you permission to use this software and documentation (if
+ * any) (collectively, the "Materials") pursuant to the terms and conditions
+ * of the Software License Agreement included with the Materials.  If you do
+ * not have a copy of the Software License Agreement, contact the  HSA Foundation for a copy.
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "hsa_dispatch.h"
+
+/*
+ * Completion-wait microbenchmark on the vector_copy kernel, with every
+ * strategy in turn: spin, blocked, hybrid, and through a shared Waiter
+ * thread.
+ *
+ * The first run issues small dispatches one at a time on the first GPU
+ * and reports the dispatch-to-wakeup latency, from the dispatch call
+ * returning to the waiting thread running again. The second keeps
+ * [outstanding] dispatches in flight, spread over one queue per GPU agent,
+ * and reports the completion rate: the waiting modes wait for the oldest
+ * dispatch and refill its place, while the Waiter watches all of them at
+ * once and a completion callback refills. Both report the CPU time of the
+ * waiting threads only, the calling thread and for the Waiter its thread,
+ * per second of wall time, so 100% is one core busy; the runtime's own
+ * threads are not counted.
+ *
+ * Usage: wait_bench <vector_copy.brig> [dispatches per mode] [outstanding]
+ */
+
+#define BENCH_GRID 256
+#define BENCH_WORKGROUP 256
+#define BENCH_OUTSTANDING 16
+
+struct __attribute__ ((aligned(16))) args_t {
+    void* in;
+    void* out;
+};
+
+/* CPU time of the calling thread. */
+static double thread_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/*
+ * CPU time of the waiter's thread, read on that thread by the callback of
+ * complete, a signal that is already 0.
+ */
+static double waiter_cpu_seconds(Waiter& waiter, hsa_signal_t complete) {
+    std::promise<double> sample;
+    std::future<double> cpu = sample.get_future();
+    waiter.watch(complete, [&sample] { sample.set_value(thread_cpu_seconds()); });
+    return cpu.get();
+}
+
+static void report(const char* name, std::vector<double>& latency, double wall_sec, double cpu_sec) {
+    std::sort(latency.begin(), latency.end());
+    double sum = 0;
+    for (size_t i = 0; i < latency.size(); i++) {
+        sum += latency[i];
+    }
+    printf("%-8s  avg %8.1f us  p50 %8.1f us  p99 %8.1f us  cpu %5.1f%%\n", name, sum / latency.size() * 1e6,
+           latency[latency.size() / 2] * 1e6, latency[latency.size() * 99 / 100] * 1e6, cpu_sec / wall_sec * 100);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <vector_copy.brig> [dispatches per mode] [outstanding]\n", argv[0]);
+        return 1;
+    }
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 0) : 2000;
+    if (count == 0) {
+        count = 1;
+    }
+    size_t outstanding = argc > 3 ? strtoul(argv[3], NULL, 0) : BENCH_OUTSTANDING;
+    if (outstanding == 0) {
+        outstanding = 1;
+    }
+
+    Runtime runtime;
+    std::vector<Agent> agents = Agent::gpus();
+    if (agents.empty()) {
+        printf("No GPU agent found.\n");
+        return 1;
+    }
+    Program program(runtime, argv[1]);
+    std::vector<Queue*> queues;
+    std::vector<Executable*> executables;
+    std::vector<Kernel*> kernels;
+    for (size_t a = 0; a < agents.size(); a++) {
+        queues.push_back(new Queue(agents[a]));
+        executables.push_back(new Executable(program, agents[a]));
+        kernels.push_back(new Kernel(*executables[a], "&__vector_copy_kernel"));
+    }
+    Queue& queue = *queues[0];
+    Kernel& kernel = *kernels[0];
+    printf("Agent %s, %zu dispatches of %d work-items per mode\n", agents[0].name, count, BENCH_GRID);
+
+    char* in = (char*)malloc(BENCH_GRID * 4);
+    char* out = (char*)malloc(BENCH_GRID * 4);
+    memset(in, 1, BENCH_GRID * 4);
+    hsa_check(hsa_memory_register(in, BENCH_GRID * 4), "Registering argument memory for input parameter");
+    hsa_check(hsa_memory_register(out, BENCH_GRID * 4), "Registering argument memory for output parameter");
+    args_t args;
+    args.in = in;
+    args.out = out;
+    Grid grid(BENCH_GRID, BENCH_WORKGROUP);
+
+    /*
+     * Mode WAIT_HYBRID + 1 stands for the shared Waiter thread.
+     */
+    Waiter waiter;
+    hsa_signal_t complete;
+    hsa_check(hsa_signal_create(0, 0, NULL, &complete), "Creating a HSA signal");
+    std::vector<double> latency(count);
+    for (int mode = WAIT_SPIN; mode <= WAIT_HYBRID + 1; mode++) {
+        double cpu_start = thread_cpu_seconds();
+        double waiter_start = mode > WAIT_HYBRID ? waiter_cpu_seconds(waiter, complete) : 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; i++) {
+            Dispatch d = dispatch(queue, kernel, grid, args);
+            std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+            if (mode <= WAIT_HYBRID) {
+                wait(d, (WaitMode)mode);
+            } else {
+                wait(d, waiter);
+            }
+            latency[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - submitted).count();
+        }
+        double wall_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double cpu_sec = thread_cpu_seconds() - cpu_start;
+        if (mode > WAIT_HYBRID) {
+            cpu_sec += waiter_cpu_seconds(waiter, complete) - waiter_start;
+        }
+        report(mode <= WAIT_HYBRID ? wait_mode_name((WaitMode)mode) : "waiter", latency, wall_sec, cpu_sec);
+    }
+
+    printf("%zu dispatches outstanding on %zu queues\n", outstanding, queues.size());
+    for (int mode = WAIT_SPIN; mode <= WAIT_HYBRID + 1; mode++) {
+        double cpu_start = thread_cpu_seconds();
+        double waiter_start = mode > WAIT_HYBRID ? waiter_cpu_seconds(waiter, complete) : 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (mode <= WAIT_HYBRID) {
+            std::vector<Dispatch> inflight(outstanding);
+            for (size_t i = 0; i < count + outstanding; i++) {
+                size_t slot = i % outstanding;
+                if (i >= outstanding && i - outstanding < count) {
+                    wait(inflight[slot], (WaitMode)mode);
+                }
+                if (i < count) {
+                    size_t q = i % queues.size();
+                    inflight[slot] = dispatch(*queues[q], *kernels[q], grid, args);
+                }
+            }
+        } else {
+            std::mutex lock;
+            std::condition_variable completed;
+            size_t done = 0;
+            for (size_t i = 0; i < count; i++) {
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    completed.wait(guard, [&] { return i - done < outstanding; });
+                }
+                size_t q = i % queues.size();
+                dispatch_async(waiter, *queues[q], *kernels[q], grid, args, [&] {
+                    std::lock_guard<std::mutex> guard(lock);
+                    done++;
+                    completed.notify_one();
+                });
+            }
+            std::unique_lock<std::mutex> guard(lock);
+            completed.wait(guard, [&] { return done == count; });
+        }
+        double wall_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double cpu_sec = thread_cpu_seconds() - cpu_start;
+        if (mode > WAIT_HYBRID) {
+            cpu_sec += waiter_cpu_seconds(waiter, complete) - waiter_start;
+        }
+        printf("%-8s  %10.0f dispatches/s  cpu %5.1f%%\n", mode <= WAIT_HYBRID ? wait_mode_name((WaitMode)mode) : "waiter",
+               count / wall_sec, cpu_sec / wall_sec * 100);
+    }
+
+    hsa_signal_destroy(complete);
+    for (size_t a = 0; a < agents.size(); a++) {
+        delete kernels[a];
+        delete executables[a];
+        delete queues[a];
+    }
+    hsa_memory_deregister(in, BENCH_GRID * 4);
+    hsa_memory_deregister(out, BENCH_GRID * 4);
+    free(in);
+    free(out);
+    return 0;
+}
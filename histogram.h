@@ -0,0 +1,80 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdio.h>
+#include <hip/hip_runtime.h>
+
+// number of in-flight chunks per GPU in streaming mode
+#define STREAM_BUFFERS 2
+
+typedef struct {
+    // host-side input the plan pulls chunks from (shared by all plans)
+    unsigned int* input_h;
+
+    // --input mode: the registered window of the mapped file the plan last
+    // pulled a chunk from and its device pointer, or staged set when
+    // registration failed and chunks are copied through staging_h / input_d.
+    // badElem is the first out-of-range element the plan found, or -1.
+    bool staged;
+    unsigned int* window_h;
+    unsigned int* window_d;
+    long long badElem;
+
+    // dynamic scheduling counters: chunks and elements this GPU pulled, and
+    // the wall time until its last chunk completed
+    unsigned int chunksDone;
+    unsigned long long elemsDone;
+    double busySec;
+
+    // device-resident bins for this GPU, and the host copy they are read back into
+    unsigned int* bins_d;
+    unsigned int* bins_h;
+
+    // global atomics issued by the aggregated kernel, on the device and read back
+    unsigned long long* atomics_d;
+    unsigned long long atomics;
+
+    // stream for asynchronous command execution
+    hipStream_t stream;
+
+    // streaming mode: a separate copy stream and double-buffered pinned
+    // staging / device chunks, so the copy of chunk k+1 overlaps the kernel on chunk k
+    hipStream_t copyStream;
+    unsigned int* staging_h[STREAM_BUFFERS];
+    unsigned int* input_d[STREAM_BUFFERS];
+    hipEvent_t copied[STREAM_BUFFERS];
+    hipEvent_t consumed[STREAM_BUFFERS];
+} TGPUplan;
+
+// histogram shape and launch parameters, set from the command line
+typedef struct {
+    unsigned int numBins;       // number of bins
+    unsigned int maxVal;        // inputs in [0, maxVal] map onto numBins equal-width bins
+    unsigned int blockSize;     // threads per workgroup
+    unsigned int inputLength;   // elements in the generated (non-streaming) input
+} THistoConfig;
+
+// sliding-window histogram kept resident on one device: a ring of the last
+// windowChunks input chunks and the bins over all of them
+typedef struct {
+    unsigned int windowChunks;
+    unsigned int chunkLength;
+    unsigned int head;          // ring slot the next chunk enters (the oldest once full)
+    unsigned int filled;        // chunks currently in the window
+    unsigned int* ring_d;
+    unsigned int* bins_d;
+    unsigned long long* atomics_d;
+    hipStream_t stream;
+} THistoWindow;
+
+// source of fixed-size input chunks for streaming mode: a file of raw
+// unsigned ints, or (when fp is NULL) a generator of genLength values
+// cycling through [0, maxVal]
+typedef struct {
+    FILE* fp;
+    size_t genLength;
+    unsigned int maxVal;
+    size_t pos;
+} TStreamSource;
+
+#endif
@@ -2,25 +2,180 @@
 #include <stdio.h>
 #include <iostream>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <hip/hip_runtime.h>
 #include "histogram.h"
 using namespace std;
 
-#define BLOCK_SIZE 128
-#define NUM_BINS 128
-#define MAX_VAL 127
+#define DEFAULT_BLOCK_SIZE 128
+#define DEFAULT_NUM_BINS 128
+#define DEFAULT_INPUT_LENGTH 128
+#define MAX_LDS_BINS 8192
+#define SORT_BINS_THRESHOLD (1 << 20)
+#define SORT_RADIX_BITS 8
 #define MAX_GPU_COUNT 7
-#define INPUT_LENGTH 128
+#define STREAM_CHUNK (1 << 20)
+#define SCHED_CHUNK (1 << 16)
+#define SCHED_DEPTH 2
+#define CPU_SUB_HISTOS 4
+#define CPU_MIN_ELEMS_PER_THREAD (1 << 16)
+#define GRID_BLOCKS_PER_CU 4
+#define REGISTER_WINDOW_CHUNKS 256
+#define WINDOW_ELEMS ((size_t)SCHED_CHUNK * REGISTER_WINDOW_CHUNKS)
+
+// scheduleChunks stages a mapped input through the streaming buffers
+#if SCHED_DEPTH > STREAM_BUFFERS
+#error "SCHED_DEPTH must not exceed STREAM_BUFFERS"
+#endif
+
+// binOf maps a value in [0, maxVal] onto one of numBins equal-width bins;
+// values index the bins directly when the range matches the bin count
+__host__ __device__ inline unsigned int binOf(unsigned int v, unsigned int numBins, unsigned int maxVal) {
+    if (maxVal + 1ull == numBins) {
+        return v;
+    }
+    return (unsigned int)(((unsigned long long)v * numBins) / (maxVal + 1ull));
+}
 
 // histogramCPU computes the histogram of an input array on the CPU
-void histogramCPU(unsigned int* input, unsigned int* bins, unsigned int numElems) {
+void histogramCPU(unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal) {
     for (int i=0; i<numElems; i++) {
-        bins[input[i]]++;
+        bins[binOf(input[i], numBins, maxVal)]++;
+    }
+}
+
+// histogramCPUReplicated computes the histogram of an input array on one core.
+// Consecutive elements go to CPU_SUB_HISTOS interleaved sub-histograms, so runs
+// of equal values do not stall on a store-to-load dependency through one bin.
+void histogramCPUReplicated(const unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal) {
+    std::vector<unsigned int> sub(CPU_SUB_HISTOS * numBins, 0);
+    unsigned int* s0 = &sub[0];
+    unsigned int* s1 = s0 + numBins;
+    unsigned int* s2 = s1 + numBins;
+    unsigned int* s3 = s2 + numBins;
+
+    unsigned int i = 0;
+    for (; i + CPU_SUB_HISTOS <= numElems; i += CPU_SUB_HISTOS) {
+        s0[binOf(input[i], numBins, maxVal)]++;
+        s1[binOf(input[i+1], numBins, maxVal)]++;
+        s2[binOf(input[i+2], numBins, maxVal)]++;
+        s3[binOf(input[i+3], numBins, maxVal)]++;
+    }
+    for (; i < numElems; i++) {
+        s0[binOf(input[i], numBins, maxVal)]++;
+    }
+
+    // merge the sub-histograms; unit-stride so the compiler vectorizes it
+    for (unsigned int j=0; j<numBins; j++) {
+        bins[j] += s0[j] + s1[j] + s2[j] + s3[j];
+    }
+}
+
+// histogramCPUParallel splits the input across host threads, each building
+// private bins with histogramCPUReplicated, and sums them into bins
+void histogramCPUParallel(const unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal) {
+    unsigned int threadN = std::thread::hardware_concurrency();
+    if (threadN == 0) {
+        threadN = 1;
+    }
+    if (threadN > numElems / CPU_MIN_ELEMS_PER_THREAD) {
+        threadN = numElems / CPU_MIN_ELEMS_PER_THREAD;
+    }
+    if (threadN <= 1) {
+        histogramCPUReplicated(input, bins, numElems, numBins, maxVal);
+        return;
+    }
+
+    std::vector<unsigned int> privBins(threadN * numBins, 0);
+    std::vector<std::thread> workers;
+    unsigned int chunk = numElems / threadN;
+    for (unsigned int t=0; t<threadN; t++) {
+        unsigned int begin = t * chunk;
+        unsigned int count = (t == threadN-1) ? numElems - begin : chunk;
+        workers.push_back(std::thread(histogramCPUReplicated, input + begin, &privBins[t * numBins], count, numBins, maxVal));
+    }
+    for (unsigned int t=0; t<threadN; t++) {
+        workers[t].join();
+    }
+
+    for (unsigned int t=0; t<threadN; t++) {
+        const unsigned int* src = &privBins[t * numBins];
+        for (unsigned int j=0; j<numBins; j++) {
+            bins[j] += src[j];
+        }
     }
 }
 
+// histogramSortRLE computes a sparse histogram for very large bin counts:
+// the inputs are mapped to bin keys, LSD radix sorted over only as many
+// digits as numBins needs, and run-length encoded into (bin, count) pairs.
+// Returns the number of pairs, i.e. the number of non-empty bins.
+size_t histogramSortRLE(const unsigned int* input, unsigned int numElems, unsigned int numBins, unsigned int maxVal,
+                        std::vector<unsigned int>& runBins, std::vector<unsigned int>& runCounts) {
+    const unsigned int radix = 1 << SORT_RADIX_BITS;
+    std::vector<unsigned int> keys(numElems), tmp(numElems);
+    for (unsigned int k=0; k<numElems; k++) {
+        keys[k] = binOf(input[k], numBins, maxVal);
+    }
+
+    unsigned int keyBits = 0;
+    while (keyBits < 32 && ((numBins - 1) >> keyBits) != 0) {
+        keyBits += SORT_RADIX_BITS;
+    }
+    for (unsigned int shift = 0; shift < keyBits; shift += SORT_RADIX_BITS) {
+        std::vector<unsigned int> offset(radix, 0);
+        for (unsigned int k=0; k<numElems; k++) {
+            offset[(keys[k] >> shift) & (radix - 1)]++;
+        }
+        unsigned int sum = 0;
+        for (unsigned int d=0; d<radix; d++) {
+            unsigned int c = offset[d];
+            offset[d] = sum;
+            sum += c;
+        }
+        for (unsigned int k=0; k<numElems; k++) {
+            tmp[offset[(keys[k] >> shift) & (radix - 1)]++] = keys[k];
+        }
+        keys.swap(tmp);
+    }
+
+    runBins.clear();
+    runCounts.clear();
+    for (unsigned int k=0; k<numElems; ) {
+        unsigned int end = k + 1;
+        while (end < numElems && keys[end] == keys[k]) {
+            end++;
+        }
+        runBins.push_back(keys[k]);
+        runCounts.push_back(end - k);
+        k = end;
+    }
+    return runBins.size();
+}
+
+// histogramSortCPU adds the sort-and-RLE histogram of input into dense bins,
+// returns the number of non-empty bins
+size_t histogramSortCPU(const unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal) {
+    std::vector<unsigned int> runBins, runCounts;
+    size_t runs = histogramSortRLE(input, numElems, numBins, maxVal, runBins, runCounts);
+    for (size_t r=0; r<runs; r++) {
+        bins[runBins[r]] += runCounts[r];
+    }
+    return runs;
+}
+
 // histogramGPU computes the histogram of an input array on the GPU
-__global__ void histogramGPU(unsigned int* input, unsigned int* bins, unsigned int numElems) {
+__global__ void histogramGPU(unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal) {
     int threadN = hipGridDim_x * hipBlockDim_x;
 
     // compute global thread coordinates
@@ -29,12 +184,704 @@ __global__ void histogramGPU(unsigned int* input, unsigned int* bins, unsigned i
     // update private histogram
     for (int pos = tx; pos < numElems; pos += threadN) { 
         //bins[input[pos]]++;
-        atomicAdd(&(bins[input[pos]]), 1);
+        atomicAdd(&(bins[binOf(input[pos], numBins, maxVal)]), 1);
+    }
+
+}
+
+// histogramSubGPU removes the contribution of an input array from bins,
+// retiring the chunk that leaves a sliding window
+__global__ void histogramSubGPU(unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal) {
+    int threadN = hipGridDim_x * hipBlockDim_x;
+
+    // compute global thread coordinates
+    int tx = (hipBlockIdx_x * hipBlockDim_x) + hipThreadIdx_x;
+
+    for (int pos = tx; pos < numElems; pos += threadN) {
+        atomicSub(&(bins[binOf(input[pos], numBins, maxVal)]), 1);
+    }
+}
+
+// histogramSharedGPU computes the histogram of an input array on the GPU,
+// privatizing the bins per workgroup in LDS and merging them into the
+// global bins once per workgroup. The loop is grid-stride and the grid is
+// capped, so each workgroup's bins cover many blocks of input. BINS fixes the bin count at compile time
+// for the common sizes; BINS == 0 is the generic instantiation, whose LDS
+// bins are sized at launch.
+template <unsigned int BINS>
+__global__ void histogramSharedGPU(unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal) {
+    __shared__ unsigned int staticBins[BINS == 0 ? 1 : BINS];
+    HIP_DYNAMIC_SHARED(unsigned int, dynamicBins);
+    unsigned int* privBins = (BINS == 0) ? dynamicBins : staticBins;
+    const unsigned int nb = (BINS == 0) ? numBins : BINS;
+    int threadN = hipGridDim_x * hipBlockDim_x;
+
+    // compute global thread coordinates
+    int tx = (hipBlockIdx_x * hipBlockDim_x) + hipThreadIdx_x;
+
+    // clear private histogram
+    for (int i = hipThreadIdx_x; i < nb; i += hipBlockDim_x) {
+        privBins[i] = 0;
+    }
+    __syncthreads();
+
+    // update private histogram
+    for (int pos = tx; pos < numElems; pos += threadN) {
+        atomicAdd(&(privBins[binOf(input[pos], nb, maxVal)]), 1);
+    }
+    __syncthreads();
+
+    // merge private histogram into the global one, skipping empty bins
+    for (int i = hipThreadIdx_x; i < nb; i += hipBlockDim_x) {
+        if (privBins[i] != 0) {
+            atomicAdd(&(bins[i]), privBins[i]);
+        }
+    }
+}
+
+// histogramAggregatedGPU computes the histogram of an input array on the GPU,
+// aggregating atomics per wavefront: the lowest pending lane broadcasts its
+// bin, every lane with the same bin joins it via a ballot, and the leader
+// issues a single atomicAdd for the whole group. Low-entropy inputs then cost
+// one global atomic per distinct bin per wavefront rather than one per element.
+// The number of bin atomics issued is added to atomics, once per wavefront.
+__global__ void histogramAggregatedGPU(unsigned int* input, unsigned int* bins, unsigned int numElems, unsigned int numBins, unsigned int maxVal,
+                                       unsigned long long* atomics) {
+    int threadN = hipGridDim_x * hipBlockDim_x;
+
+    // compute global thread coordinates; base is uniform across the wavefront
+    int tx = (hipBlockIdx_x * hipBlockDim_x) + hipThreadIdx_x;
+    int lane = hipThreadIdx_x % warpSize;
+    unsigned long long issued = 0;
+
+    for (unsigned int base = tx - lane; base < numElems; base += threadN) {
+        unsigned int pos = base + lane;
+        bool valid = pos < numElems;
+        unsigned int bin = valid ? binOf(input[pos], numBins, maxVal) : 0;
+
+        unsigned long long pending = __ballot(valid);
+        while (pending) {
+            int leader = __ffsll(pending) - 1;
+            unsigned int leaderBin = __shfl(bin, leader);
+            unsigned long long peers = __ballot(valid && bin == leaderBin) & pending;
+            if (lane == leader) {
+                atomicAdd(&(bins[leaderBin]), (unsigned int)__popcll(peers));
+            }
+            pending &= ~peers;
+            issued++;
+        }
+    }
+
+    // the loop ran in lockstep, so every lane counted the wavefront's atomics
+    if (lane == 0 && issued != 0) {
+        atomicAdd(atomics, issued);
+    }
+}
+
+// reduceBins sums the per-GPU histograms read back into plan[i].bins_h;
+// the inner loop is unit-stride so the compiler vectorizes it
+void reduceBins(TGPUplan* plan, int GPU_N, unsigned int* bins, unsigned int numBins) {
+    memset(bins, 0, numBins*sizeof(unsigned int));
+    for (int i=0; i<GPU_N; i++) {
+        const unsigned int* __restrict__ src = plan[i].bins_h;
+        for (unsigned int j=0; j<numBins; j++) {
+            bins[j] += src[j];
+        }
     }
+}
 
+// kernel variants selectable from the command line
+enum HistoKernel {
+    HISTO_KERNEL_GLOBAL,    // one global atomic per input element
+    HISTO_KERNEL_SHARED,    // per-workgroup LDS bins, one global atomic per non-empty bin
+    HISTO_KERNEL_AGGREGATED,// wavefront-aggregated global atomics, one per distinct bin per wavefront
+    HISTO_KERNEL_SORT       // host radix sort + run-length encoding, for very large bin counts
+};
+
+// kernelName describes the instantiation launchHistogram picks for cfg
+const char* kernelName(HistoKernel kernel, const THistoConfig* cfg) {
+    if (kernel == HISTO_KERNEL_SORT) {
+        return "histogramSortRLE";
+    }
+    if (kernel == HISTO_KERNEL_AGGREGATED) {
+        return "histogramAggregatedGPU";
+    }
+    if (kernel == HISTO_KERNEL_SHARED && cfg->numBins <= MAX_LDS_BINS) {
+        switch (cfg->numBins) {
+        case 64:   return "histogramSharedGPU<64>";
+        case 128:  return "histogramSharedGPU<128>";
+        case 256:  return "histogramSharedGPU<256>";
+        case 1024: return "histogramSharedGPU<1024>";
+        default:   return "histogramSharedGPU<dynamic>";
+        }
+    }
+    return "histogramGPU";
 }
 
-int main(void) {
+// cappedGrid returns the workgroup count for the privatizing kernels: one per
+// blockSize elements, but at most GRID_BLOCKS_PER_CU per compute unit of the
+// current device. Their loops are grid-stride, so a capped grid makes every
+// workgroup's clear and merge of its private bins pay off over many elements.
+unsigned int cappedGrid(unsigned int numElems, unsigned int blockSize) {
+    static unsigned int cuCount[MAX_GPU_COUNT];
+    int dev = 0;
+    hipGetDevice(&dev);
+    if (cuCount[dev] == 0) {
+        int cus = 0;
+        hipDeviceGetAttribute(&cus, hipDeviceAttributeMultiprocessorCount, dev);
+        cuCount[dev] = cus > 0 ? cus : 1;
+    }
+    unsigned int blocks = (numElems + blockSize - 1) / blockSize;
+    unsigned int cap = cuCount[dev] * GRID_BLOCKS_PER_CU;
+    return blocks < cap ? blocks : cap;
+}
+
+// launchHistogram enqueues the selected kernel over numElems inputs on stream.
+// The shared kernel dispatches to a fixed-size instantiation for the common bin
+// counts, to the dynamically sized one for other counts that fit in LDS, and
+// falls back to global atomics when the bins do not fit. The shared and
+// aggregated kernels run on a grid capped by cappedGrid.
+void launchHistogram(HistoKernel kernel, const THistoConfig* cfg, unsigned int* input, unsigned int* bins, unsigned int numElems,
+                     unsigned long long* atomics, hipStream_t stream) {
+    dim3 threadPerBlock(cfg->blockSize, 1, 1);
+    dim3 blockPerGrid(ceil(numElems/(float)cfg->blockSize), 1, 1);
+    unsigned int numBins = cfg->numBins;
+    unsigned int maxVal = cfg->maxVal;
+    if ((kernel == HISTO_KERNEL_SHARED && numBins <= MAX_LDS_BINS) || kernel == HISTO_KERNEL_AGGREGATED) {
+        blockPerGrid.x = cappedGrid(numElems, cfg->blockSize);
+    }
+    if (kernel == HISTO_KERNEL_SHARED && numBins <= MAX_LDS_BINS) {
+        switch (numBins) {
+        case 64:
+            hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramSharedGPU<64>), dim3(blockPerGrid), dim3(threadPerBlock), 0, stream, input, bins, numElems, numBins, maxVal);
+            break;
+        case 128:
+            hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramSharedGPU<128>), dim3(blockPerGrid), dim3(threadPerBlock), 0, stream, input, bins, numElems, numBins, maxVal);
+            break;
+        case 256:
+            hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramSharedGPU<256>), dim3(blockPerGrid), dim3(threadPerBlock), 0, stream, input, bins, numElems, numBins, maxVal);
+            break;
+        case 1024:
+            hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramSharedGPU<1024>), dim3(blockPerGrid), dim3(threadPerBlock), 0, stream, input, bins, numElems, numBins, maxVal);
+            break;
+        default:
+            hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramSharedGPU<0>), dim3(blockPerGrid), dim3(threadPerBlock), numBins*sizeof(unsigned int), stream, input, bins, numElems, numBins, maxVal);
+            break;
+        }
+    } else if (kernel == HISTO_KERNEL_AGGREGATED) {
+        hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramAggregatedGPU), dim3(blockPerGrid), dim3(threadPerBlock), 0, stream, input, bins, numElems, numBins, maxVal, atomics);
+    } else {
+        hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramGPU), dim3(blockPerGrid), dim3(threadPerBlock), 0, stream, input, bins, numElems, numBins, maxVal);
+    }
+
+    hipError_t err = hipGetLastError();
+    if (err != hipSuccess) {
+        fprintf(stderr, "Launching %s failed: %s\n", kernelName(kernel, cfg), hipGetErrorString(err));
+        exit(1);
+    }
+}
+
+// checkRange returns the index of the first value outside [0, maxVal], or -1
+long checkRange(const unsigned int* input, size_t numElems, unsigned int maxVal) {
+    for (size_t k=0; k<numElems; k++) {
+        if (input[k] > maxVal) {
+            return (long)k;
+        }
+    }
+    return -1;
+}
+
+// registered windows of a mapped --input file, shared by all GPU plans. The
+// GPUs pull chunks from one cursor, so their chunks interleave; a window of
+// REGISTER_WINDOW_CHUNKS chunks is therefore pinned once, portable to every
+// device, by whichever plan first pulls a chunk from it, and stays registered
+// until the run ends. state holds 0 (not yet), 1 (registered) or -1 (refused).
+struct TInputWindows {
+    unsigned int* base;
+    size_t numElems;
+    std::mutex lock;
+    std::vector<signed char> state;
+};
+
+// registerWindow registers window w of the mapped input unless that was
+// already tried, returns whether it is registered
+bool registerWindow(TInputWindows* windows, size_t w) {
+    std::lock_guard<std::mutex> guard(windows->lock);
+    if (windows->state[w] == 0) {
+        size_t first = w * WINDOW_ELEMS;
+        size_t n = (windows->numElems - first < WINDOW_ELEMS) ? windows->numElems - first : WINDOW_ELEMS;
+        hipError_t err = hipHostRegister(windows->base + first, n * sizeof(unsigned int),
+                                         hipHostRegisterMapped | hipHostRegisterPortable | hipHostRegisterReadOnly);
+        windows->state[w] = err == hipSuccess ? 1 : -1;
+    }
+    return windows->state[w] == 1;
+}
+
+// unregisterWindows releases every registered window once all plans are done
+void unregisterWindows(TInputWindows* windows) {
+    for (size_t w=0; w < windows->state.size(); w++) {
+        if (windows->state[w] == 1) {
+            hipHostUnregister(windows->base + w * WINDOW_ELEMS);
+        }
+    }
+}
+
+// sliceInput returns a device pointer to elements [begin, begin+count) of the
+// mapped --input file for the chunk in slot: an offset into the registered
+// window holding it, whose device pointer the plan looks up once per window.
+// If the runtime refuses a registration, the plan copies this and all later
+// chunks through its pinned staging buffers instead.
+unsigned int* sliceInput(TGPUplan* plan, TInputWindows* windows, int slot, size_t begin, unsigned int count) {
+    unsigned int* host = windows->base + begin;
+    size_t bytes = count * sizeof(unsigned int);
+    if (!plan->staged) {
+        size_t w = begin / WINDOW_ELEMS;
+        unsigned int* window = windows->base + w * WINDOW_ELEMS;
+        if (plan->window_h != window) {
+            plan->window_h = window;
+            if (!registerWindow(windows, w) || hipHostGetDevicePointer((void**)&plan->window_d, window, 0) != hipSuccess) {
+                fprintf(stderr, "Registering the input failed, staging the copies instead\n");
+                plan->staged = true;
+                for (int b=0; b < SCHED_DEPTH; b++) {
+                    hipHostMalloc((void**)&plan->staging_h[b], SCHED_CHUNK * sizeof(unsigned int));
+                    hipMalloc((void**)&plan->input_d[b], SCHED_CHUNK * sizeof(unsigned int));
+                }
+            }
+        }
+        if (!plan->staged) {
+            return plan->window_d + (host - window);
+        }
+    }
+    // the slot's previous chunk has completed, so its staging buffer is free
+    memcpy(plan->staging_h[slot], host, bytes);
+    hipMemcpyAsync(plan->input_d[slot], plan->staging_h[slot], bytes, hipMemcpyHostToDevice, plan->stream);
+    return plan->input_d[slot];
+}
+
+// scheduleChunks runs on one host thread per GPU. It pulls SCHED_CHUNK-sized
+// ranges from the shared cursor and histograms them on the plan's stream until
+// the input is drained. A GPU only pulls once it has fewer than SCHED_DEPTH
+// chunks in flight, so faster devices end up taking more of the input.
+// With windows the input is a mapped file: its chunks are range-checked as they
+// are pulled, and the first bad element is stored in badElem and drains the
+// cursor for every GPU.
+void scheduleChunks(TGPUplan* plan, int dev, HistoKernel kernel, const THistoConfig* cfg, unsigned int numElems, std::atomic<size_t>* cursor,
+                    TInputWindows* windows) {
+    hipEvent_t done[SCHED_DEPTH];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    hipSetDevice(dev);
+    for (int d=0; d < SCHED_DEPTH; d++) {
+        hipEventCreateWithFlags(&done[d], hipEventDisableTiming);
+    }
+    plan->chunksDone = 0;
+    plan->elemsDone = 0;
+
+    for (unsigned int k = 0; ; k++) {
+        int slot = k % SCHED_DEPTH;
+        if (k >= SCHED_DEPTH) {
+            hipEventSynchronize(done[slot]);
+        }
+        size_t begin = cursor->fetch_add(SCHED_CHUNK);
+        if (begin >= numElems) {
+            break;
+        }
+        unsigned int count = (numElems - begin < SCHED_CHUNK) ? numElems - begin : SCHED_CHUNK;
+        unsigned int* input = plan->input_h + begin;
+        if (windows != NULL) {
+            long bad = checkRange(input, count, cfg->maxVal);
+            if (bad >= 0) {
+                plan->badElem = begin + bad;
+                cursor->store(numElems);
+                break;
+            }
+            input = sliceInput(plan, windows, slot, begin, count);
+        }
+        launchHistogram(kernel, cfg, input, plan->bins_d, count, plan->atomics_d, plan->stream);
+        hipEventRecord(done[slot], plan->stream);
+        plan->chunksDone++;
+        plan->elemsDone += count;
+    }
+    hipStreamSynchronize(plan->stream);
+    plan->busySec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (int d=0; d < SCHED_DEPTH; d++) {
+        hipEventDestroy(done[d]);
+    }
+    if (plan->staged) {
+        for (int b=0; b < SCHED_DEPTH; b++) {
+            hipHostFree(plan->staging_h[b]);
+            hipFree(plan->input_d[b]);
+        }
+    }
+}
+
+// verifyBins compares a histogram against the CPU reference, returns 0 on a match
+int verifyBins(const unsigned int* bins_CPU, const unsigned int* bins, unsigned int numBins) {
+    for (unsigned int i=0; i<numBins; i++) {
+        if (bins_CPU[i] != bins[i]) {
+            fprintf(stderr, "Result verification failed at element (%d)!\n", i);
+            printf("CPU: %d\n", bins_CPU[i]);
+            printf("GPU: %d\n", bins[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// readChunk fills dst with up to maxN values from src, returns the count read
+size_t readChunk(TStreamSource* src, unsigned int* dst, size_t maxN) {
+    size_t n;
+    if (src->fp != NULL) {
+        n = fread(dst, sizeof(unsigned int), maxN, src->fp);
+    } else {
+        n = src->genLength - src->pos;
+        if (n > maxN) {
+            n = maxN;
+        }
+        for (size_t k=0; k<n; k++) {
+            dst[k] = (src->pos + k) % (src->maxVal + 1ull);
+        }
+    }
+    src->pos += n;
+    return n;
+}
+
+// windowCreate allocates an empty sliding window of windowChunks chunks of
+// chunkLength elements on the current device
+void windowCreate(THistoWindow* win, const THistoConfig* cfg, unsigned int windowChunks, unsigned int chunkLength) {
+    win->windowChunks = windowChunks;
+    win->chunkLength = chunkLength;
+    win->head = 0;
+    win->filled = 0;
+    hipStreamCreate(&win->stream);
+    hipMalloc((void**)&win->ring_d, (size_t)windowChunks * chunkLength * sizeof(unsigned int));
+    hipMalloc((void**)&win->bins_d, cfg->numBins * sizeof(unsigned int));
+    hipMemsetAsync(win->bins_d, 0, cfg->numBins * sizeof(unsigned int), win->stream);
+    hipMalloc((void**)&win->atomics_d, sizeof(unsigned long long));
+    hipMemsetAsync(win->atomics_d, 0, sizeof(unsigned long long), win->stream);
+}
+
+// windowAdvance slides the window by one chunk. Once the window is full the
+// oldest chunk's counts are subtracted; chunk_h then replaces it in the
+// device ring and its counts are added. Only the entering and leaving chunks
+// are processed and the bins never leave the device. Work is queued on the
+// window's stream in that order, so chunk_h may be reused on return.
+void windowAdvance(THistoWindow* win, HistoKernel kernel, const THistoConfig* cfg, const unsigned int* chunk_h) {
+    unsigned int* slot = win->ring_d + (size_t)win->head * win->chunkLength;
+    if (win->filled == win->windowChunks) {
+        dim3 threadPerBlock(cfg->blockSize, 1, 1);
+        dim3 blockPerGrid(ceil(win->chunkLength/(float)cfg->blockSize), 1, 1);
+        hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramSubGPU), dim3(blockPerGrid), dim3(threadPerBlock), 0, win->stream, slot, win->bins_d, win->chunkLength, cfg->numBins, cfg->maxVal);
+    } else {
+        win->filled++;
+    }
+    hipMemcpyAsync(slot, chunk_h, win->chunkLength * sizeof(unsigned int), hipMemcpyHostToDevice, win->stream);
+    launchHistogram(kernel, cfg, slot, win->bins_d, win->chunkLength, win->atomics_d, win->stream);
+    win->head = (win->head + 1) % win->windowChunks;
+}
+
+// windowRead copies the current window histogram to bins_h
+void windowRead(THistoWindow* win, const THistoConfig* cfg, unsigned int* bins_h) {
+    hipMemcpyAsync(bins_h, win->bins_d, cfg->numBins * sizeof(unsigned int), hipMemcpyDeviceToHost, win->stream);
+    hipStreamSynchronize(win->stream);
+}
+
+void windowDestroy(THistoWindow* win) {
+    hipStreamSynchronize(win->stream);
+    hipFree(win->ring_d);
+    hipFree(win->bins_d);
+    hipFree(win->atomics_d);
+    hipStreamDestroy(win->stream);
+}
+
+// histogramWindow slides a window of windowChunks chunks over ticks generated
+// chunks of cfg->inputLength elements and checks the window histogram
+// against histogramCPU over the full window after every tick. Without a GPU
+// the window is maintained incrementally on the host instead.
+int histogramWindow(int GPU_N, HistoKernel kernel, const THistoConfig* cfg, unsigned int windowChunks, unsigned int ticks,
+                    unsigned int* bins, unsigned int* bins_CPU) {
+    unsigned int chunkLength = cfg->inputLength;
+    size_t histoSize = cfg->numBins * sizeof(unsigned int);
+    std::vector<unsigned int> ring((size_t)windowChunks * chunkLength);
+    std::vector<unsigned int> leaving(cfg->numBins);
+    THistoWindow win;
+    unsigned int seed = 1;
+    int rc = 0;
+
+    if (GPU_N > 0) {
+        hipSetDevice(0);
+        windowCreate(&win, cfg, windowChunks, chunkLength);
+    } else {
+        memset(bins, 0, histoSize);
+    }
+
+    for (unsigned int t=0; t<ticks && rc == 0; t++) {
+        unsigned int slot = t % windowChunks;
+        unsigned int* chunk = &ring[(size_t)slot * chunkLength];
+
+        // host-side incremental fallback retires the leaving chunk first
+        if (GPU_N == 0 && t >= windowChunks) {
+            memset(&leaving[0], 0, histoSize);
+            histogramCPU(chunk, &leaving[0], chunkLength, cfg->numBins, cfg->maxVal);
+            for (unsigned int j=0; j<cfg->numBins; j++) {
+                bins[j] -= leaving[j];
+            }
+        }
+
+        // a drifting pseudo-random distribution, so consecutive windows differ
+        for (unsigned int k=0; k<chunkLength; k++) {
+            seed = seed * 1103515245u + 12345u;
+            chunk[k] = ((seed >> 8) % (cfg->maxVal / 2 + 1ull) + (unsigned long long)t * 7) % (cfg->maxVal + 1ull);
+        }
+
+        if (GPU_N > 0) {
+            windowAdvance(&win, kernel, cfg, chunk);
+            windowRead(&win, cfg, bins);
+        } else {
+            histogramCPU(chunk, bins, chunkLength, cfg->numBins, cfg->maxVal);
+        }
+
+        unsigned int inWindow = (t + 1 < windowChunks) ? t + 1 : windowChunks;
+        memset(bins_CPU, 0, histoSize);
+        histogramCPU(&ring[0], bins_CPU, inWindow * chunkLength, cfg->numBins, cfg->maxVal);
+        if (verifyBins(bins_CPU, bins, cfg->numBins) != 0) {
+            fprintf(stderr, "Window mismatch at tick %u\n", t);
+            rc = 1;
+        }
+    }
+
+    if (GPU_N > 0) {
+        windowDestroy(&win);
+    }
+    if (rc == 0) {
+        printf("Window: %u chunks of %u elements, %u ticks verified\n", windowChunks, chunkLength, ticks);
+    }
+    return rc;
+}
+
+// reportAtomics prints the global atomics the aggregated kernel issued
+// against the number of elements it processed
+void reportAtomics(TGPUplan* plan, int GPU_N, unsigned long long numElems) {
+    unsigned long long atomics = 0;
+    for (int i=0; i<GPU_N; i++) {
+        atomics += plan[i].atomics;
+    }
+    printf("Global atomics: %llu for %llu elements (%.2f elements per atomic)\n", atomics, numElems,
+           atomics > 0 ? (double)numElems / atomics : 0.0);
+}
+
+// referenceChunk adds the histogramCPU reference of one streamed chunk to
+// bins_CPU and returns the seconds it took, which the caller leaves out of
+// its timing; the input is read only once, so FIFOs can be checked too
+double referenceChunk(unsigned int* chunk, size_t n, const THistoConfig* cfg, unsigned int* bins_CPU) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    histogramCPU(chunk, bins_CPU, n, cfg->numBins, cfg->maxVal);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// histogramStream computes the histogram of src chunk by chunk. Chunks are
+// dealt round-robin to the GPUs; on each GPU the host fills one pinned staging
+// buffer while the previous chunk is copied on copyStream and histogrammed on
+// stream. bins_CPU receives the CPU reference of every chunk as it is read;
+// the time spent on it is subtracted from the reported time.
+int histogramStream(TGPUplan* plan, int GPU_N, HistoKernel kernel, const THistoConfig* cfg, TStreamSource* src, unsigned int* bins, unsigned int* bins_CPU) {
+    size_t histoSize = cfg->numBins * sizeof(unsigned int);
+    size_t chunkSize = STREAM_CHUNK * sizeof(unsigned int);
+    size_t chunk = 0, total = 0;
+    double refSec = 0;
+    int i, b, rc = 0;
+
+    memset(bins, 0, histoSize);
+    memset(bins_CPU, 0, histoSize);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    if (GPU_N == 0) {
+        unsigned int* cpuChunk = (unsigned int*)malloc(chunkSize);
+        size_t n;
+        while ((n = readChunk(src, cpuChunk, STREAM_CHUNK)) > 0) {
+            long bad = checkRange(cpuChunk, n, cfg->maxVal);
+            if (bad >= 0) {
+                fprintf(stderr, "Input value %u at element %zu exceeds max value\n", cpuChunk[bad], total + bad);
+                rc = 1;
+                break;
+            }
+            refSec += referenceChunk(cpuChunk, n, cfg, bins_CPU);
+            if (kernel == HISTO_KERNEL_SORT) {
+                histogramSortCPU(cpuChunk, bins, n, cfg->numBins, cfg->maxVal);
+            } else {
+                histogramCPUParallel(cpuChunk, bins, n, cfg->numBins, cfg->maxVal);
+            }
+            chunk++;
+            total += n;
+        }
+        free(cpuChunk);
+    } else {
+        for (i=0; i < GPU_N; i++) {
+            hipSetDevice(i);
+            hipStreamCreate(&plan[i].stream);
+            hipStreamCreate(&plan[i].copyStream);
+            hipMalloc((void**)&plan[i].bins_d, histoSize);
+            hipMemsetAsync(plan[i].bins_d, 0, histoSize, plan[i].stream);
+            hipMalloc((void**)&plan[i].atomics_d, sizeof(unsigned long long));
+            hipMemsetAsync(plan[i].atomics_d, 0, sizeof(unsigned long long), plan[i].stream);
+            hipHostMalloc((void**)&plan[i].bins_h, histoSize);
+            for (b=0; b < STREAM_BUFFERS; b++) {
+                hipHostMalloc((void**)&plan[i].staging_h[b], chunkSize);
+                hipMalloc((void**)&plan[i].input_d[b], chunkSize);
+                hipEventCreateWithFlags(&plan[i].copied[b], hipEventDisableTiming);
+                hipEventCreateWithFlags(&plan[i].consumed[b], hipEventDisableTiming);
+                hipEventRecord(plan[i].consumed[b], plan[i].stream);
+            }
+        }
+
+        for (;;) {
+            i = chunk % GPU_N;
+            b = (chunk / GPU_N) % STREAM_BUFFERS;
+            hipSetDevice(i);
+
+            // the kernel that last read this slot must finish before it is refilled
+            hipEventSynchronize(plan[i].consumed[b]);
+            size_t n = readChunk(src, plan[i].staging_h[b], STREAM_CHUNK);
+            if (n == 0) {
+                break;
+            }
+            long bad = checkRange(plan[i].staging_h[b], n, cfg->maxVal);
+            if (bad >= 0) {
+                fprintf(stderr, "Input value %u at element %zu exceeds max value\n", plan[i].staging_h[b][bad], total + bad);
+                rc = 1;
+                break;
+            }
+
+            hipMemcpyAsync(plan[i].input_d[b], plan[i].staging_h[b], n*sizeof(unsigned int), hipMemcpyHostToDevice, plan[i].copyStream);
+            hipEventRecord(plan[i].copied[b], plan[i].copyStream);
+            hipStreamWaitEvent(plan[i].stream, plan[i].copied[b], 0);
+            launchHistogram(kernel, cfg, plan[i].input_d[b], plan[i].bins_d, n, plan[i].atomics_d, plan[i].stream);
+            hipEventRecord(plan[i].consumed[b], plan[i].stream);
+
+            // the host only reads the staged chunk, so this overlaps the copy and kernel
+            refSec += referenceChunk(plan[i].staging_h[b], n, cfg, bins_CPU);
+
+            chunk++;
+            total += n;
+        }
+
+        for (i=0; i < GPU_N; i++) {
+            hipSetDevice(i);
+            hipMemcpyAsync(plan[i].bins_h, plan[i].bins_d, histoSize, hipMemcpyDeviceToHost, plan[i].stream);
+            hipStreamSynchronize(plan[i].stream);
+            hipMemcpy(&plan[i].atomics, plan[i].atomics_d, sizeof(unsigned long long), hipMemcpyDeviceToHost);
+        }
+        reduceBins(plan, GPU_N, bins, cfg->numBins);
+        if (kernel == HISTO_KERNEL_AGGREGATED) {
+            reportAtomics(plan, GPU_N, total);
+        }
+
+        for (i=0; i < GPU_N; i++) {
+            hipSetDevice(i);
+            for (b=0; b < STREAM_BUFFERS; b++) {
+                hipEventDestroy(plan[i].copied[b]);
+                hipEventDestroy(plan[i].consumed[b]);
+                hipHostFree(plan[i].staging_h[b]);
+                hipFree(plan[i].input_d[b]);
+            }
+            hipFree(plan[i].bins_d);
+            hipFree(plan[i].atomics_d);
+            hipHostFree(plan[i].bins_h);
+            hipStreamDestroy(plan[i].copyStream);
+            hipStreamDestroy(plan[i].stream);
+        }
+    }
+
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - refSec;
+    printf("Streamed %zu elements in %zu chunks, %.3f s, %.2f GB/s\n", total, chunk, sec, total * sizeof(unsigned int) / sec / 1e9);
+    return rc;
+}
+
+// mapInput maps a file of raw unsigned ints read-only, so the GPU plans can
+// read it straight from the page cache without a fill pass or staging copy.
+// Returns NULL on failure; the mapping length is stored in bytes.
+unsigned int* mapInput(const char* path, size_t* bytes) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    *bytes = st.st_size;
+    return (unsigned int*)addr;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [global|shared|aggregated|sort] [--bins <n>] [--max-val <v>] [--block <n>] [--length <n>]\n"
+                    "          [--input <file> | --stream <file> | --stream-gen <count> | --window <chunks> [--ticks <n>]]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    // kernel selection and input source
+    HistoKernel kernel = HISTO_KERNEL_GLOBAL;
+    const char* inputFile = NULL;
+    const char* streamFile = NULL;
+    size_t streamLength = 0;
+    unsigned int windowChunks = 0;
+    unsigned int ticks = 16;
+    THistoConfig cfg = { DEFAULT_NUM_BINS, 0, DEFAULT_BLOCK_SIZE, DEFAULT_INPUT_LENGTH };
+    bool maxValSet = false;
+    for (int a=1; a<argc; a++) {
+        if (strcmp(argv[a], "global") == 0) {
+            kernel = HISTO_KERNEL_GLOBAL;
+        } else if (strcmp(argv[a], "shared") == 0) {
+            kernel = HISTO_KERNEL_SHARED;
+        } else if (strcmp(argv[a], "aggregated") == 0) {
+            kernel = HISTO_KERNEL_AGGREGATED;
+        } else if (strcmp(argv[a], "sort") == 0) {
+            kernel = HISTO_KERNEL_SORT;
+        } else if (strcmp(argv[a], "--input") == 0 && a+1 < argc) {
+            inputFile = argv[++a];
+        } else if (strcmp(argv[a], "--stream") == 0 && a+1 < argc) {
+            streamFile = argv[++a];
+        } else if (strcmp(argv[a], "--stream-gen") == 0 && a+1 < argc) {
+            streamLength = strtoull(argv[++a], NULL, 0);
+        } else if (strcmp(argv[a], "--window") == 0 && a+1 < argc) {
+            windowChunks = strtoul(argv[++a], NULL, 0);
+        } else if (strcmp(argv[a], "--ticks") == 0 && a+1 < argc) {
+            ticks = strtoul(argv[++a], NULL, 0);
+        } else if (strcmp(argv[a], "--bins") == 0 && a+1 < argc) {
+            cfg.numBins = strtoul(argv[++a], NULL, 0);
+        } else if (strcmp(argv[a], "--max-val") == 0 && a+1 < argc) {
+            cfg.maxVal = strtoul(argv[++a], NULL, 0);
+            maxValSet = true;
+        } else if (strcmp(argv[a], "--block") == 0 && a+1 < argc) {
+            cfg.blockSize = strtoul(argv[++a], NULL, 0);
+        } else if (strcmp(argv[a], "--length") == 0 && a+1 < argc) {
+            cfg.inputLength = strtoul(argv[++a], NULL, 0);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!maxValSet) {
+        cfg.maxVal = cfg.numBins - 1;
+    }
+    if (cfg.numBins == 0 || cfg.blockSize == 0 || cfg.maxVal + 1ull < cfg.numBins) {
+        fprintf(stderr, "Need at least one bin, a non-empty block and max value >= bins - 1\n");
+        exit(1);
+    }
+
+    // neither global nor LDS atomics hold up at millions of bins
+    if (cfg.numBins > SORT_BINS_THRESHOLD) {
+        kernel = HISTO_KERNEL_SORT;
+    }
+
     // data params
     TGPUplan plan[MAX_GPU_COUNT];
     int GPU_N, i, j, gpuBase;
@@ -42,11 +889,10 @@ int main(void) {
     unsigned int* hostInput; unsigned int* hostBins;
 
     // determine
-    size_t histoSize = NUM_BINS * sizeof(unsigned int);
-    size_t inSize = INPUT_LENGTH * sizeof(unsigned int);
+    size_t histoSize = cfg.numBins * sizeof(unsigned int);
+    size_t inSize = cfg.inputLength * sizeof(unsigned int);
 
     // allocate host memory
-    hostInput = (unsigned int*)malloc(inSize);
     hostBins = (unsigned int*)malloc(histoSize);
     hostBins_CPU = (unsigned int*)malloc(histoSize);
 
@@ -58,14 +904,95 @@ int main(void) {
     }
 
     printf("CUDA-capable device count: %i\n", GPU_N);
+    if (kernel == HISTO_KERNEL_SORT) {
+        // the sort engine runs on the host and is validated against histogramCPU
+        GPU_N = 0;
+    } else if (GPU_N == 0) {
+        printf("No GPU found, falling back to the CPU backend\n");
+    }
+    for (i=0; i<GPU_N; i++) {
+        int maxThreads = 0;
+        hipDeviceGetAttribute(&maxThreads, hipDeviceAttributeMaxThreadsPerBlock, i);
+        if (cfg.blockSize > (unsigned int)maxThreads) {
+            fprintf(stderr, "Block size %u exceeds the %d threads per block of device %d\n", cfg.blockSize, maxThreads, i);
+            exit(1);
+        }
+    }
+    printf("Bins: %u, values: [0, %u], block size: %u\n", cfg.numBins, cfg.maxVal, cfg.blockSize);
+    printf("Kernel: %s\n", kernelName(kernel, &cfg));
 
-    for (i=0; i < GPU_N; i++) {
-        plan[i].dataN = INPUT_LENGTH/GPU_N;
-        //plan[i].dataN = INPUT_LENGTH;
+    // sliding-window mode over chunks of inputLength elements
+    if (windowChunks != 0) {
+        int rc = histogramWindow(GPU_N, kernel, &cfg, windowChunks, ticks, hostBins, hostBins_CPU);
+        if (rc == 0) {
+            printf("Test PASSED\n");
+        }
+        for (i=0; i<GPU_N; i++) {
+            hipSetDevice(i);
+            hipDeviceReset();
+        }
+        free(hostBins); free(hostBins_CPU);
+        printf("end\n");
+        return rc;
+    }
+
+    // streaming mode
+    if (streamFile != NULL || streamLength != 0) {
+        TStreamSource src = { NULL, streamLength, cfg.maxVal, 0 };
+        if (streamFile != NULL) {
+            src.fp = fopen(streamFile, "rb");
+            if (src.fp == NULL) {
+                fprintf(stderr, "Cannot open %s\n", streamFile);
+                exit(1);
+            }
+        }
+        int rc = histogramStream(plan, GPU_N, kernel, &cfg, &src, hostBins, hostBins_CPU);
+        if (src.fp != NULL) {
+            fclose(src.fp);
+        }
+        if (rc == 0) {
+            rc = verifyBins(hostBins_CPU, hostBins, cfg.numBins);
+        }
+        if (rc == 0) {
+            printf("Test PASSED\n");
+        }
+        for (i=0; i<GPU_N; i++) {
+            hipSetDevice(i);
+            hipDeviceReset();
+        }
+        free(hostBins); free(hostBins_CPU);
+        printf("end\n");
+        return rc;
     }
 
-    for (i=0; i<INPUT_LENGTH; i++) {
-        hostInput[i] = i;
+    // input: a read-only mapping of the input file, registered window by
+    // window as the GPUs pull chunks, or a generated array in host memory
+    if (inputFile != NULL) {
+        hostInput = mapInput(inputFile, &inSize);
+        if (hostInput == NULL) {
+            fprintf(stderr, "Cannot map %s\n", inputFile);
+            exit(1);
+        }
+        if (inSize / sizeof(unsigned int) > UINT_MAX) {
+            fprintf(stderr, "%s has more than %u elements, use --stream\n", inputFile, UINT_MAX);
+            exit(1);
+        }
+        cfg.inputLength = inSize / sizeof(unsigned int);
+        // the GPU schedulers check each chunk as they pull it; the CPU engines
+        // index the bins directly, so check the whole file before they run
+        if (GPU_N == 0) {
+            long bad = checkRange(hostInput, cfg.inputLength, cfg.maxVal);
+            if (bad >= 0) {
+                fprintf(stderr, "Input value %u at element %ld exceeds max value\n", hostInput[bad], bad);
+                exit(1);
+            }
+        }
+        printf("Mapped %s: %u elements\n", inputFile, cfg.inputLength);
+    } else {
+        hostInput = (unsigned int*)malloc(inSize);
+        for (i=0; i<cfg.inputLength; i++) {
+            hostInput[i] = i % (cfg.maxVal + 1ull);
+        }
     }
 
     //for (i=0; i<INPUT_LENGTH/GPU_N; i++) {
@@ -73,72 +1000,115 @@ int main(void) {
     //        hostInput[i+INPUT_LENGTH/GPU_N*j] = i;
     //}
 
-    for (i=0; i<NUM_BINS; i++) {
-        hostBins[i] = 0;
-    }
-
     // allocate device memory
     for (i=0; i < GPU_N; i++) {
         hipSetDevice(i);
         hipStreamCreate(&plan[i].stream);
-        plan[i].input_h = (unsigned int*) malloc(plan[i].dataN*sizeof(unsigned int));
-        for (j=0; j < plan[i].dataN; j++) {
-            plan[i].input_h[j] = hostInput[j+(plan[i].dataN*i)];
-            //plan[i].input_h[j] = hostInput[j];
-            //printf("plan[%d].input_h[%d] = %d\n", i, j, plan[i].input_h[j]);
-       }
+        hipMalloc((void**)&plan[i].bins_d, histoSize);
+        hipMemsetAsync(plan[i].bins_d, 0, histoSize, plan[i].stream);
+        hipMalloc((void**)&plan[i].atomics_d, sizeof(unsigned long long));
+        hipMemsetAsync(plan[i].atomics_d, 0, sizeof(unsigned long long), plan[i].stream);
+        hipHostMalloc((void**)&plan[i].bins_h, histoSize);
+        plan[i].input_h = hostInput;
+        plan[i].staged = false;
+        plan[i].window_h = NULL;
+        plan[i].window_d = NULL;
+        plan[i].badElem = -1;
     }
 
+    TInputWindows windows;
+    windows.base = hostInput;
+    windows.numElems = cfg.inputLength;
+    windows.state.assign((cfg.inputLength + WINDOW_ELEMS - 1) / WINDOW_ELEMS, 0);
+
 
-    // kernel launch
+    // kernel launch: every GPU pulls chunks from one shared cursor
+    std::atomic<size_t> cursor(0);
+    std::vector<std::thread> schedulers;
     for (i=0; i < GPU_N; i++) {
-        hipSetDevice(i);
-        dim3 threadPerBlock(BLOCK_SIZE, 1, 1);
-        //dim3 threadPerBlock(1, 1, 1);
-        dim3 blockPerGrid(ceil(plan[i].dataN/(float)BLOCK_SIZE), 1, 1);
-        //dim3 blockPerGrid(1, 1, 1);
-        //printf("plan[%d].dataN = %d\n", i, plan[i].dataN);
-        hipLaunchKernelGGL(HIP_KERNEL_NAME(histogramGPU), dim3(blockPerGrid), dim3(threadPerBlock), 0, plan[i].stream, plan[i].input_h, hostBins, plan[i].dataN);
+        schedulers.push_back(std::thread(scheduleChunks, &plan[i], i, kernel, &cfg, cfg.inputLength, &cursor,
+                                         inputFile != NULL ? &windows : (TInputWindows*)NULL));
+    }
+    for (i=0; i < GPU_N; i++) {
+        schedulers[i].join();
+    }
+    unregisterWindows(&windows);
+    for (i=0; i < GPU_N; i++) {
+        if (plan[i].badElem >= 0) {
+            fprintf(stderr, "Input value %u at element %lld exceeds max value\n", hostInput[plan[i].badElem], plan[i].badElem);
+            exit(1);
+        }
     }
 
     
     for (i=0; i < GPU_N; i++) {
         hipSetDevice(i);
+        // read back only numBins words per GPU
+        hipMemcpyAsync(plan[i].bins_h, plan[i].bins_d, histoSize, hipMemcpyDeviceToHost, plan[i].stream);
         hipStreamSynchronize(plan[i].stream);
-        //for (j=0; j < NUM_BINS; j++) {
-        //    hostBins[j]+= plan[i].bins_h[j];
-        //}
+        hipMemcpy(&plan[i].atomics, plan[i].atomics_d, sizeof(unsigned long long), hipMemcpyDeviceToHost);
         hipStreamDestroy(plan[i].stream);
+        printf("GPU %d: %u chunks, %llu elements, %.3f s, %.2f Melem/s\n", i, plan[i].chunksDone, plan[i].elemsDone,
+               plan[i].busySec, plan[i].busySec > 0 ? plan[i].elemsDone / plan[i].busySec / 1e6 : 0.0);
+    }
+
+    // reduce the per-GPU histograms
+    reduceBins(plan, GPU_N, hostBins, cfg.numBins);
+    if (kernel == HISTO_KERNEL_AGGREGATED && GPU_N > 0) {
+        reportAtomics(plan, GPU_N, cfg.inputLength);
+    }
+
+    // CPU backend when there is no GPU to run on
+    if (kernel == HISTO_KERNEL_SORT) {
+        size_t runs = histogramSortCPU(hostInput, hostBins, cfg.inputLength, cfg.numBins, cfg.maxVal);
+        printf("Non-empty bins: %zu\n", runs);
+    } else if (GPU_N == 0) {
+        histogramCPUParallel(hostInput, hostBins, cfg.inputLength, cfg.numBins, cfg.maxVal);
     }
     
 
     // initialize CPU histogram array to 0
-    for (int i=0; i<NUM_BINS; i++) {
+    for (int i=0; i<cfg.numBins; i++) {
         hostBins_CPU[i] = 0;
     }
 
-    // run the CPU version
-    histogramCPU(hostInput, hostBins_CPU, INPUT_LENGTH);
+    // run the CPU version; the CPU backend is checked against the scalar reference
+    if (GPU_N == 0) {
+        histogramCPU(hostInput, hostBins_CPU, cfg.inputLength, cfg.numBins, cfg.maxVal);
+    } else {
+        histogramCPUParallel(hostInput, hostBins_CPU, cfg.inputLength, cfg.numBins, cfg.maxVal);
 
-    for (int i=0; i<NUM_BINS; i++) {
-        if (abs(int(hostBins_CPU[i] - hostBins[i])) > 0) {
-            fprintf(stderr, "Result verification failed at element (%d)!\n", i);
-            printf("CPU: %d\n", hostBins_CPU[i]);
-            printf("GPU: %d\n", hostBins[i]);
+        // the threaded reference is itself checked against the scalar one, so a
+        // bad merge of the per-thread bins cannot pass the GPU result
+        std::vector<unsigned int> scalarBins(cfg.numBins, 0);
+        histogramCPU(hostInput, &scalarBins[0], cfg.inputLength, cfg.numBins, cfg.maxVal);
+        if (verifyBins(&scalarBins[0], hostBins_CPU, cfg.numBins) != 0) {
+            fprintf(stderr, "histogramCPUParallel disagrees with histogramCPU\n");
             exit(1);
         }
     }
+
+    if (verifyBins(hostBins_CPU, hostBins, cfg.numBins) != 0) {
+        exit(1);
+    }
     printf("Test PASSED\n");
 
 
     for (i=0; i<GPU_N; i++) {
           hipSetDevice(i);
-          free(plan[i].input_h);
+          hipFree(plan[i].bins_d);
+          hipFree(plan[i].atomics_d);
+          hipHostFree(plan[i].bins_h);
           hipDeviceReset();
     }
 
     // release resources
-    free(hostBins); free(hostBins_CPU); free(hostInput);
+    if (inputFile != NULL) {
+        munmap(hostInput, inSize);
+    } else {
+        free(hostInput);
+    }
+    free(hostBins); free(hostBins_CPU);
     printf("end\n");
     return 0;
 }